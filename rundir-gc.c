@@ -0,0 +1,105 @@
+/*
+ * pam_rundir - Copyright (C) 2015 Olivier Brunel
+ *
+ * rundir-gc.c
+ * Copyright (C) 2015 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see http://www.gnu.org/licenses/
+ */
+
+/*
+ * Usage: rundir-gc [-n] [-r] [-j THREADS] [OPTION]...
+ *
+ * Removes what sessions left behind in PARENT_DIR (see rundir_gc()), e.g. from
+ * a timer or at boot, refilling the pool (pool=), then prints what was found:
+ *
+ *   rundir-gc dirs=12 counters=14 orphans=1 unused=2 lingering=0 busy=0 ...
+ *
+ * OPTIONs are the module's, as on its configuration line (dir=, counters=,
+ * tmpfs, ...), and must match it.
+ *
+ *   -n          dry run, only report
+ *   -r          only empty the trash and refill the pool: the reaper the
+ *               module runs after sessions (see reaper=)
+ *   -j THREADS  threads removing the trash [online CPUs]
+ *
+ * Must be run as root. Errors are logged to syslog, and stderr.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rundir.h"
+
+static void
+usage(int status)
+{
+    fprintf(status ? stderr : stdout,
+            "Usage: rundir-gc [-n] [-r] [-j THREADS] [OPTION]...\n");
+    exit(status);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct rundir_gc_stats stats;
+    char threads[32];
+    const char **args;
+    struct rundir *rd;
+    int flags = 0;
+    int opt;
+    int n;
+    int r;
+
+    snprintf(threads, sizeof(threads), "reaper_threads=%ld", sysconf(_SC_NPROCESSORS_ONLN));
+    while ((opt = getopt(argc, argv, "hnrj:")) != -1) {
+        switch (opt) {
+            case 'n': flags |= RUNDIR_GC_DRY_RUN; break;
+            case 'r': flags |= RUNDIR_GC_REAP_ONLY; break;
+            case 'j': snprintf(threads, sizeof(threads), "reaper_threads=%s", optarg); break;
+            case 'h': usage(0); break;
+            default: usage(1);
+        }
+    }
+
+    /* Module options, after the threads so an explicit reaper_threads= wins */
+    args = malloc((argc - optind + 1) * sizeof(*args));
+    if (args == NULL) {
+        perror("rundir-gc: malloc");
+        return 1;
+    }
+    args[0] = threads;
+    for (n = 1; optind < argc; ++n)
+        args[n] = argv[optind++];
+
+    openlog("rundir-gc", LOG_PERROR | LOG_PID, LOG_AUTHPRIV);
+    rd = rundir_new(n, args);
+    if (rd == NULL)
+        return 1;
+
+    r = rundir_gc(rd, flags, &stats);
+    printf("rundir-gc dirs=%lu counters=%lu orphans=%lu unused=%lu lingering=%lu busy=%lu"
+           " tombstones=%lu removed=%lu failed=%lu pooled=%lu%s\n",
+           stats.dirs, stats.counters, stats.orphans, stats.unused, stats.lingering,
+           stats.busy, stats.tombstones, stats.removed, stats.failed, stats.pooled,
+           (flags & RUNDIR_GC_DRY_RUN) ? " dry_run=1" : "");
+
+    rundir_free(rd);
+    free(args);
+    return (r == RUNDIR_OK) ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+/*
+ * pam_rundir - Copyright (C) 2015 Olivier Brunel
+ *
+ * rundir-status.c
+ * Copyright (C) 2015 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see http://www.gnu.org/licenses/
+ */
+
+/*
+ * Usage: rundir-status [-s] [OPTION]...
+ *
+ * Prints the state of every user in PARENT_DIR (see rundir_status()), one line
+ * each, then totals, e.g. for a monitoring agent:
+ *
+ *   uid=1000 sessions=2 dir=1 expires=0
+ *   uid=1001 sessions=0 dir=1 expires=1760000000
+ *   rundir-status users=2 sessions=2 dirs=2 lingering=1 unusable=0 errors=0
+ *
+ * OPTIONs are the module's, as on its configuration line (dir=, counters=,
+ * ...), and must match it.
+ *
+ *   -s  only print the totals
+ *
+ * No lock is taken, so it never waits for (nor delays) sessions. Errors are
+ * logged to syslog, and stderr.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rundir.h"
+
+static void
+usage(int status)
+{
+    fprintf(status ? stderr : stdout, "Usage: rundir-status [-s] [OPTION]...\n");
+    exit(status);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct rundir_status *status;
+    struct rundir *rd;
+    unsigned long sessions = 0, dirs = 0, lingering = 0, unusable = 0, errors = 0;
+    int summary = 0;
+    size_t n, i;
+    int opt;
+    int r;
+
+    while ((opt = getopt(argc, argv, "hs")) != -1) {
+        switch (opt) {
+            case 's': summary = 1; break;
+            case 'h': usage(0); break;
+            default: usage(1);
+        }
+    }
+
+    openlog("rundir-status", LOG_PERROR | LOG_PID, LOG_AUTHPRIV);
+    rd = rundir_new(argc - optind, (const char **) argv + optind);
+    if (rd == NULL)
+        return 1;
+
+    r = rundir_status(rd, &status, &n);
+    if (r != RUNDIR_OK) {
+        rundir_free(rd);
+        return 1;
+    }
+
+    for (i = 0; i < n; ++i) {
+        const struct rundir_status *st = &status[i];
+
+        if (st->sessions > 0)
+            sessions += st->sessions;
+        else if (st->sessions == -2)
+            ++unusable;
+        else if (st->sessions == -1)
+            ++errors;
+        dirs += st->has_dir;
+        lingering += (st->expires != 0);
+        if (!summary)
+            printf("uid=%u sessions=%d dir=%d expires=%lld\n", (unsigned) st->uid,
+                   st->sessions, st->has_dir, (long long) st->expires);
+    }
+    printf("rundir-status users=%zu sessions=%lu dirs=%lu lingering=%lu unusable=%lu errors=%lu\n",
+           n, sessions, dirs, lingering, unusable, errors);
+
+    free(status);
+    rundir_free(rd);
+    return 0;
+}
@@ -0,0 +1,5000 @@
+/*
+ * pam_rundir - Copyright (C) 2015 Olivier Brunel
+ *
+ * rundir.c
+ * Copyright (C) 2015 Olivier Brunel <jjk@jjacky.com>
+ *
+ * librundir: the runtime directory protocol (counters, locking, creation and
+ * teardown), used by the PAM module and callable directly, see rundir.h
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see http://www.gnu.org/licenses/
+ */
+
+#define _GNU_SOURCE
+#include "config.h"
+#include "rundir.h"
+#include "trace.h"
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/statfs.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <syslog.h>
+#include <string.h>
+#include <pwd.h>
+#include <grp.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/* io_uring is used through raw syscalls, so only the kernel headers are needed;
+ * IORING_FEAT_NATIVE_WORKERS (5.12) means they're recent enough to know
+ * IORING_OP_UNLINKAT (5.11) */
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_FEAT_NATIVE_WORKERS) && defined(__NR_io_uring_setup)
+#define HAVE_URING 1
+#endif
+#endif
+#endif
+
+/* USDT probes, for tracing tools (bpftrace, perf, SystemTap...); without
+ * --enable-usdt they compile to nothing */
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+#define PROBE(name)             DTRACE_PROBE(pam_rundir, name)
+#define PROBE1(name, a)         DTRACE_PROBE1(pam_rundir, name, a)
+#define PROBE2(name, a, b)      DTRACE_PROBE2(pam_rundir, name, a, b)
+#define PROBE3(name, a, b, c)   DTRACE_PROBE3(pam_rundir, name, a, b, c)
+#else
+#define PROBE(name)
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#endif
+
+/* Constants */
+#define MAX_UID_LENGTH 10          /* Maximum length of a 32-bit integer as string */
+#define COUNTER_MAGIC 0x43445252   /* "RRDC" */
+#define COUNTER_VERSION 1
+#define COUNTER_UNUSABLE 0x0001    /* Flag: dir not usable, but not a failure */
+#define MAX_PATH_LEN 4096          /* Maximum path length */
+#define MAX_DIR_LEN 3968           /* Maximum length of dir=, leaving room for names */
+#define MAX_VAR_LEN 64             /* Maximum length of envvar= */
+#define DEFAULT_UMASK 0077         /* Runtime dirs are 0700 */
+#define MAX_TMPFS_VALUE 31         /* Maximum length of tmpfs_size=/tmpfs_nr_inodes= */
+#define LOCK_TIMEOUT 5000          /* Default lock deadline in milliseconds */
+#define LOCK_WAIT_STACK 65536      /* Stack of the thread blocked on a contended lock */
+#define PWCACHE_NAME ".pwcache"    /* Passwd cache file, inside PARENT_DIR */
+#define PWCACHE_SLOTS 1024         /* Number of entries in the passwd cache */
+#define PWCACHE_PROBES 8           /* Slots looked at for a given name */
+#define PWBUF_SIZE 1024            /* Initial buffer for getpwnam_r() */
+#define PWBUF_MAX (1 << 20)        /* Largest buffer tried for getpwnam_r() */
+#define TRASH_NAME ".trash"        /* Tombstones awaiting removal, in PARENT_DIR */
+#define POOL_NAME ".pool"          /* Directories ready to be runtime dirs, in PARENT_DIR */
+#define MAX_POOL 1024              /* Maximum of pool= */
+#define POOL_BUF 4096              /* getdents64 buffer for taking from the pool */
+#define USAGE_NAME ".usage"        /* Top users by teardown size, in PARENT_DIR */
+#define USAGE_MAGIC 0x53554452     /* "RDUS" */
+#define USAGE_VERSION 1
+#define MAX_USAGE 4096             /* Maximum of usage= */
+#define TABLE_NAME ".counters"     /* Shared counter table, in PARENT_DIR */
+#define TABLE_MAGIC 0x42544452     /* "RDTB" */
+#define TABLE_VERSION 1
+#define TABLE_SLOTS 65536          /* Users the counter table can hold */
+#define LINGER_NAME ".linger"      /* Next linger expiry (mtime), in PARENT_DIR */
+#define LINGER_NEVER ((time_t) 1 << 33) /* Expiry of LINGER_NAME when none due */
+#define RATELIMIT_SLOTS 16         /* Distinct messages tracked for ratelimiting */
+#define RATELIMIT_INTERVAL 10      /* Ratelimiting window, in seconds */
+#define RATELIMIT_BURST 5          /* Messages allowed per key and window */
+#define STATS_NAME ".stats"        /* Statistics file, inside PARENT_DIR */
+#define STATS_MAGIC 0x54534452     /* "RDST" */
+#define STATS_VERSION 1
+#define HIST_BUCKETS 7             /* < 10us, < 100us, ..., < 1s, >= 1s */
+#define URING_BATCH 64             /* Unlinks submitted to io_uring at once */
+#define MAX_REAPER_THREADS 64      /* Maximum of reaper_threads= */
+#define REAPER_QUEUE 1024          /* Directories queued, beyond that recurse */
+#define REGISTRY_MAX 1024          /* Sessions registered per user, beyond that only counted */
+#define MAX_TRACE_RECORDS (1 << 24) /* Maximum of trace= */
+#define DENTS_BUF 32768            /* Buffer for getdents64, listing directories */
+#define MAX_RULES 32               /* Patterns of include= and exclude=, all together */
+#define MAX_RULES_LEN 1024         /* Room for those patterns */
+#define MAX_GROUPS 64              /* Groups of a user looked at first, for group: rules */
+#define MAX_EXTRA_DIRS 8           /* Maximum of extra_dir= */
+#define MAX_EXTRA_NAME 64          /* Maximum length of an extra_dir= template */
+#define MAX_NAME_LEN (MAX_EXTRA_NAME + MAX_UID_LENGTH) /* Of a user's dir in PARENT_DIR */
+
+#ifndef REAPER_PATH
+#define REAPER_PATH "/sbin/rundir-gc"
+#endif
+
+/* What sessions are matched on by include= and exclude= */
+enum rule_key {
+    RULE_SERVICE = 0,
+    RULE_TTY,
+    RULE_USER,
+    RULE_GROUP,
+    NB_RULE_KEYS
+};
+
+static const char *rule_keys[NB_RULE_KEYS] = { "service", "tty", "user", "group" };
+
+/* One pattern of include= or exclude=. Patterns are offsets into the rules'
+ * buffer, so options can be copied around; a group is resolved to its gid once
+ * and for all. */
+struct rule {
+    uint8_t key;                   /* enum rule_key */
+    uint8_t exclude;
+    uint16_t pattern;              /* Offset in struct rules' buf */
+    gid_t gid;                     /* For RULE_GROUP */
+};
+
+struct rules {
+    int count;
+    int includes;                  /* How many of those are include= ones */
+    struct rule rule[MAX_RULES];
+    size_t len;                    /* Used in buf */
+    char buf[MAX_RULES_LEN];
+};
+
+/* An extra directory of the user's sessions, from extra_dir=. It is named
+ * after template, with the uid in place of its %u (at uid_at). */
+struct extra_dir {
+    char template[MAX_EXTRA_NAME + 1];
+    size_t uid_at;
+    mode_t mode;                   /* 0 for the runtime dir's */
+    char var_name[MAX_VAR_LEN + 1];
+};
+
+/* Module options, parsed from the PAM configuration line (or the arguments of
+ * rundir_new()) once, and shared by all sessions */
+struct options {
+    int debug;                     /* Log what's going on */
+    mode_t mode;                   /* Mode of runtime dirs, from umask= */
+    char dir[MAX_DIR_LEN + 1];     /* Parent dir of runtime dirs, from dir= */
+    size_t dir_len;
+    char var_name[MAX_VAR_LEN + 1]; /* Environment variable, from envvar= */
+    long lock_timeout;             /* Lock deadline in ms, 0 for one attempt */
+    long nss_cache;                /* Passwd cache TTL in seconds, 0 if off */
+    int defer_cleanup;             /* Remove runtime dirs from a reaper */
+    long linger;                   /* Seconds to keep unused runtime dirs */
+    int table;                     /* Counters in the shared table, not files */
+    int timing;                    /* Time each phase of sessions */
+    int uring;                     /* Teardown with io_uring, from teardown= */
+    long reaper_threads;           /* Threads removing the trash */
+    char reaper[MAX_DIR_LEN + 1];  /* Executable of the reaper, from reaper= */
+    int registry;                  /* Register sessions' processes in counter files */
+    long trace;                    /* Records in the trace ring, 0 if off */
+    long pool;                     /* Directories kept ready in the pool, 0 if off */
+    char skel[MAX_DIR_LEN + 1];    /* Skeleton of new runtime dirs, from skel=, or "" */
+    long usage;                    /* Users kept in the usage file, 0 if off */
+    int tmpfs;                     /* Mount a tmpfs per runtime dir */
+    char tmpfs_size[MAX_TMPFS_VALUE + 1];  /* size= of the tmpfs, if any */
+    char tmpfs_nr_inodes[MAX_TMPFS_VALUE + 1]; /* nr_inodes= of the tmpfs, if any */
+    struct rules rules;            /* From include= and exclude= */
+    int nb_extra;                  /* Directories created along the runtime dir */
+    struct extra_dir extra[MAX_EXTRA_DIRS];
+};
+
+/* Returned by rundir_new() */
+struct rundir {
+    struct options opts;
+    char **reaper_argv;            /* Command line of the reaper, see spawn_reaper() */
+};
+
+/* Statistics, kept in STATS_NAME for monitoring tools to read. It is made of a
+ * struct stats_header, followed by an array of NB_STATS 64-bit counters (host
+ * byte order), indexed as below. New counters are only ever appended.
+ */
+enum stat_id {
+    STAT_PARENT_REPAIRS = 0,       /* Times PARENT_DIR had to be fixed up */
+    /* Only maintained with the timing option */
+    STAT_SESSIONS_OPENED,          /* Sessions opened successfully */
+    STAT_SESSIONS_CLOSED,          /* Sessions closed successfully */
+    STAT_LOCKS,                    /* Counter locks taken */
+    STAT_LOCK_US,                  /* Total time taken by those, in us */
+    STAT_LOCK_HIST,                /* HIST_BUCKETS counters, by time taken */
+    STAT_TEARDOWNS = STAT_LOCK_HIST + HIST_BUCKETS, /* Runtime dirs removed */
+    STAT_TEARDOWN_US,              /* Total time taken by those, in us */
+    STAT_TEARDOWN_HIST,            /* HIST_BUCKETS counters, by time taken */
+    STAT_ENTRIES_REMOVED = STAT_TEARDOWN_HIST + HIST_BUCKETS, /* By those */
+    STAT_BYTES_REMOVED,            /* By those, with usage= as well */
+    NB_STATS
+};
+
+/* Phases of a session, timed with the timing option */
+enum phase {
+    PHASE_NSS = 0,                 /* User lookup */
+    PHASE_PARENT,                  /* ensure_parent_dir() */
+    PHASE_LOCK,                    /* Opening and locking the counter */
+    PHASE_COUNTER,                 /* Counter reads and writes */
+    PHASE_CREATE,                  /* Creating the runtime dir */
+    PHASE_TEARDOWN,                /* Removing it */
+    NB_PHASES
+};
+
+static const char *phase_names[NB_PHASES] = TRACE_PHASE_NAMES;
+_Static_assert(NB_PHASES == TRACE_PHASES, "trace records hold every phase");
+
+/* Timings of the session being handled, if enabled. Per thread, so threads
+ * handling sessions don't mix up theirs. */
+static __thread struct {
+    int enabled;
+    uid_t uid;
+    gid_t gid;
+    uint64_t session;              /* Trace id of the session, once known */
+    struct timespec start;
+    struct timespec wall;          /* Same, for the trace */
+    long us[NB_PHASES];            /* Time spent in each phase */
+    unsigned done;                 /* Bitmask of phases that happened */
+    unsigned long entries;         /* Entries removed */
+    uint64_t bytes;                /* Space they used, with usage= */
+} timing;
+
+struct stats_header {
+    uint32_t magic;
+    uint32_t version;
+};
+
+/* The usage file (usage=) is a header followed by that many records, in host
+ * byte order, for the users whose largest teardown was the biggest. It is
+ * updated under an exclusive lock (flock) on the file.
+ */
+struct usage_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t records;
+    uint32_t record_size;
+    char pad[16];
+};
+
+struct usage_record {
+    uint32_t key;                  /* uid + 1, or 0 when free */
+    uint32_t teardowns;            /* Since the user was recorded */
+    uint64_t entries;              /* Of the largest teardown */
+    uint64_t bytes;                /* Space used by those */
+    uint32_t us;                   /* Time it took */
+    uint32_t max_us;               /* Longest teardown */
+    uint64_t total_bytes;          /* Of all teardowns */
+    int64_t last;                  /* Time of the last one */
+};
+
+/* Content of a counter file */
+struct counter_record {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t count;
+    uint32_t check;                /* Checksum of the fields above */
+};
+
+/* With the registry, the counter record is followed by one of those per
+ * session, a free one having pid 0. The counter still counts all sessions,
+ * including those opened without the registry. */
+struct registry_entry {
+    uint32_t pid;                  /* Process that opened the session */
+    uint32_t pad;
+    uint64_t start;                /* Its start time (clock ticks since boot) */
+};
+
+/* The shared counter table is a header followed by TABLE_SLOTS slots, all
+ * mapped in by every process. Slots are found by open addressing on the uid,
+ * claimed once and for all, and updated with atomic ops.
+ */
+struct table_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slot_size;
+    char pad[16];
+};
+
+struct table_slot {
+    uint32_t key;                  /* uid + 1, or 0 when free */
+    int32_t count;                 /* < 0 when dir not usable */
+    int64_t expires;               /* Linger expiry, or 0 */
+    char pad[16];
+};
+
+/* A user's counter, as locked, whatever the backend */
+struct counter {
+    int fd;                        /* Counter file, or the table */
+    struct table_header *table;    /* Mapped table, or NULL */
+    struct table_slot *slot;       /* User's slot in table */
+    dev_t dev;                     /* Identity of fd */
+    ino_t ino;
+};
+
+/* Ratelimiting state of one message, keyed by its format string */
+struct ratelimit {
+    const char *key;
+    int priority;
+    time_t start;                  /* Beginning of current window */
+    unsigned int count;            /* Messages logged in current window */
+    unsigned int suppressed;       /* Messages dropped in current window */
+};
+
+static struct ratelimit ratelimits[RATELIMIT_SLOTS];
+static pthread_mutex_t ratelimits_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* One reference on a runtime directory, from rundir_acquire() to
+ * rundir_release() */
+struct rundir_session {
+    const struct rundir *rd;
+    uid_t uid;
+    gid_t gid;
+    int parentfd;                  /* O_PATH of the parent dir */
+    dev_t dev;                     /* Counter file (or table) we counted in */
+    ino_t ino;
+    int counted;                   /* Not released yet */
+    pid_t pid;                     /* Registered as, 0 if not */
+    uint64_t start;
+    uint64_t trace_id;             /* Its records in the trace */
+    char *extra;                   /* Paths of the extra dirs, one after the other */
+    char path[MAX_PATH_LEN];       /* The runtime directory */
+};
+
+/* Sessions opened by this process, for trace ids */
+static uint32_t trace_ids;
+
+/* One entry of the passwd cache file; an array of PWCACHE_SLOTS of those */
+struct pwcache_entry {
+    char name[32];                 /* NUL-padded, longer names aren't cached */
+    uint32_t uid;
+    uint32_t gid;
+    int64_t stamp;                 /* Time of resolution */
+    uint32_t check;                /* Checksum of the fields above */
+    uint32_t pad;
+};
+
+/* Forward declarations */
+static void log_error(const struct rundir *rd, const char *format, ...);
+static void log_info(const struct rundir *rd, const char *format, ...);
+static void log_debug(const struct rundir *rd, const char *format, ...);
+static int ensure_parent_dir(const struct options *opts, const struct rundir *rd);
+static int open_and_lock(int parentfd, const char *path, const struct rundir *rd,
+                         const struct options *opts);
+static int read_counter(int fd);
+static int write_counter(int fd, int count);
+static void print_filename(const struct options *opts, char *buf, int uid, int l);
+static int intlen(int n);
+static uint32_t fnv1a(const void *data, size_t len);
+static int take_from_pool(const struct options *opts, const struct rundir *rd, int parentfd,
+                          const char *name, const char *path, uid_t uid, gid_t gid,
+                          int first, int *low);
+static long fill_pool(const struct options *opts, const struct rundir *rd);
+static long long parse_uid(const char *name);
+
+/* Construct the path of name, within the parent dir, into buf (MAX_PATH_LEN) */
+static char *
+parent_path(const struct options *opts, char *buf, const char *name)
+{
+    memcpy(buf, opts->dir, opts->dir_len);
+    buf[opts->dir_len] = '/';
+    strcpy(buf + opts->dir_len + 1, name);
+    return buf;
+}
+
+#define STATS_SIZE (sizeof(struct stats_header) + NB_STATS * sizeof(uint64_t))
+
+/* Map the statistics file, creating it if needed, and return its counters;
+ * NULL on error. Counters are updated atomically through the shared mapping,
+ * so no locking is involved. */
+static uint64_t *
+stats_map(const struct options *opts)
+{
+    const size_t size = STATS_SIZE;
+    char file[MAX_PATH_LEN];
+    struct stats_header *hdr;
+    struct stat st;
+    int fd;
+
+    do { fd = open(parent_path(opts, file, STATS_NAME), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH); }
+    while (fd < 0 && errno == EINTR);
+    if (fd < 0)
+        return NULL;
+
+    /* Growing the file zero-fills new counters; never shrink it */
+    if (fstat(fd, &st) < 0 || ((size_t) st.st_size < size && ftruncate(fd, size) < 0)) {
+        close(fd);
+        return NULL;
+    }
+
+    hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED)
+        return NULL;
+
+    if (hdr->magic != STATS_MAGIC) {
+        hdr->version = STATS_VERSION;
+        hdr->magic = STATS_MAGIC;
+    }
+    return (uint64_t *) (hdr + 1);
+}
+
+static void
+stats_unmap(uint64_t *counters)
+{
+    munmap((struct stats_header *) counters - 1, STATS_SIZE);
+}
+
+/* Add n to a counter of the statistics file. Errors are ignored. */
+static void
+stats_add(const struct options *opts, enum stat_id id, uint64_t n)
+{
+    uint64_t *counters = stats_map(opts);
+
+    if (counters == NULL)
+        return;
+    __atomic_add_fetch(&counters[id], n, __ATOMIC_RELAXED);
+    stats_unmap(counters);
+}
+
+/* Count one event lasting us microseconds, in the histogram starting at hist */
+static void
+stats_hist(uint64_t *counters, enum stat_id hist, long us)
+{
+    long limit = 10;
+    int b;
+
+    for (b = 0; b < HIST_BUCKETS - 1 && us >= limit; ++b)
+        limit *= 10;
+    __atomic_add_fetch(&counters[hist + b], 1, __ATOMIC_RELAXED);
+}
+
+#define USAGE_SIZE(n) (sizeof(struct usage_header) + (n) * sizeof(struct usage_record))
+
+/* Record a teardown of uid in the usage file: entries removed, the bytes they
+ * used, and how long it took. A user not in there yet takes a free record, or
+ * that of the user whose largest teardown was the smallest, if smaller. Errors
+ * are ignored.
+ */
+static void
+usage_add(const struct options *opts, uid_t uid, uint64_t entries, uint64_t bytes, long us)
+{
+    const size_t size = USAGE_SIZE(opts->usage);
+    char file[MAX_PATH_LEN];
+    struct usage_header *hdr;
+    struct usage_record *recs, *rec = NULL, *victim = NULL;
+    struct stat st;
+    long i;
+    int fd;
+
+    do { fd = open(parent_path(opts, file, USAGE_NAME), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH); }
+    while (fd < 0 && errno == EINTR);
+    if (fd < 0)
+        return;
+    while (flock(fd, LOCK_EX) < 0)
+        if (errno != EINTR)
+            goto done;
+    if (fstat(fd, &st) < 0 || ((size_t) st.st_size != size && ftruncate(fd, size) < 0))
+        goto done;
+    hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED)
+        goto done;
+
+    /* Started over when usage= changed */
+    recs = (struct usage_record *) (hdr + 1);
+    if (hdr->magic != USAGE_MAGIC || hdr->version != USAGE_VERSION
+            || hdr->records != (uint32_t) opts->usage || hdr->record_size != sizeof(*rec)) {
+        memset(hdr, 0, size);
+        hdr->magic = USAGE_MAGIC;
+        hdr->version = USAGE_VERSION;
+        hdr->records = opts->usage;
+        hdr->record_size = sizeof(*rec);
+    }
+
+    /* The user's record, else a free one, else the smallest */
+    for (i = 0; i < opts->usage; ++i) {
+        if (recs[i].key == uid + 1) {
+            rec = &recs[i];
+            break;
+        }
+        if (!victim || (victim->key != 0 && (recs[i].key == 0 || recs[i].bytes < victim->bytes)))
+            victim = &recs[i];
+    }
+    if (!rec && victim && (victim->key == 0 || victim->bytes < bytes)) {
+        rec = victim;
+        memset(rec, 0, sizeof(*rec));
+        rec->key = uid + 1;
+    }
+    if (rec) {
+        ++rec->teardowns;
+        rec->total_bytes += bytes;
+        rec->last = time(NULL);
+        if ((uint32_t) us > rec->max_us)
+            rec->max_us = us;
+        if (bytes >= rec->bytes) {
+            rec->entries = entries;
+            rec->bytes = bytes;
+            rec->us = us;
+        }
+    }
+    munmap(hdr, size);
+
+done:
+    close(fd);
+}
+
+/* Ensure the parent directory for runtime directories exists with proper
+ * permissions. In the common case it already does, and a single stat() is all
+ * it takes; otherwise the directory is created/repaired, which is counted as
+ * STAT_PARENT_REPAIRS.
+ */
+static int
+ensure_parent_dir(const struct options *opts, const struct rundir *rd)
+{
+    struct stat st;
+    int ret = 0;
+
+    /* Fast path: already a root:root directory with mode 0755 */
+    if (fstatat(AT_FDCWD, opts->dir, &st, 0) == 0 && S_ISDIR(st.st_mode)
+            && st.st_uid == 0 && st.st_gid == 0
+            && (st.st_mode & 07777) == (S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH)) {
+        return 1;
+    }
+
+    /* Try to create the directory if it doesn't exist. The umask (process
+     * wide) is left alone, the mode is set explicitly below */
+    if (mkdir(opts->dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0) {
+        if (errno != EEXIST) {
+            log_error(rd, "Failed to create directory %s: %m", opts->dir);
+            goto out;
+        }
+        
+        /* Directory exists, verify it's actually a directory */
+        if (stat(opts->dir, &st) != 0) {
+            log_error(rd, "Failed to stat %s: %m", opts->dir);
+            goto out;
+        }
+        
+        if (!S_ISDIR(st.st_mode)) {
+            log_error(rd, "%s exists but is not a directory", opts->dir);
+            goto out;
+        }
+    }
+    
+    /* Set proper ownership (root:root) */
+    if (chown(opts->dir, 0, 0) != 0) {
+        log_error(rd, "Failed to set ownership of %s: %m", opts->dir);
+        /* Non-fatal, continue */
+    }
+    
+    /* Set secure permissions (rwxr-xr-x) */
+    if (chmod(opts->dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0) {
+        log_error(rd, "Failed to set permissions on %s: %m", opts->dir);
+        /* Non-fatal, continue */
+    }
+    
+    stats_add(opts, STAT_PARENT_REPAIRS, 1);
+    ret = 1; /* Success */
+    
+out:
+    return ret;
+}
+
+static int
+intlen (int n)
+{
+    int l;
+
+    for (l = 1; ; ++l)
+    {
+        if (n < 10)
+            break;
+        n /= 10;
+    }
+
+    return l;
+}
+
+static void
+print_int (char *s, int n, int l)
+{
+    s += l;
+    for (;;)
+    {
+        const char digits[] = "0123456789";
+
+        *--s = digits[n % 10];
+        if (n < 10)
+            break;
+        n /= 10;
+    }
+}
+
+/* Report messages dropped by the ratelimiter, if any */
+static void
+flush_suppressed(struct ratelimit *rl)
+{
+    if (rl->suppressed > 0)
+        syslog(LOG_AUTHPRIV | rl->priority,
+               "pam_rundir: suppressed %u messages like: %s", rl->suppressed, rl->key);
+    rl->suppressed = 0;
+}
+
+/* Whether a message with this format may be logged now: every format gets
+ * RATELIMIT_BURST messages per RATELIMIT_INTERVAL, further ones are only
+ * counted, and summarized once the window is over.
+ */
+static int
+ratelimit_allow(const char *key, int priority)
+{
+    struct ratelimit *rl = NULL;
+    time_t now = time(NULL);
+    int r = 0;
+    int i;
+
+    /* Shared by all handles of the process, which might be in use from
+     * different threads */
+    pthread_mutex_lock(&ratelimits_lock);
+    for (i = 0; i < RATELIMIT_SLOTS; ++i) {
+        if (ratelimits[i].key == key && ratelimits[i].priority == priority) {
+            rl = &ratelimits[i];
+            break;
+        }
+        if (!rl || ratelimits[i].start < rl->start)
+            rl = &ratelimits[i];
+    }
+
+    if (rl->key != key || rl->priority != priority) {
+        /* Recycle the least recently started slot */
+        flush_suppressed(rl);
+        rl->key = key;
+        rl->priority = priority;
+        rl->start = now;
+        rl->count = 0;
+    } else if (now - rl->start >= RATELIMIT_INTERVAL || now < rl->start) {
+        flush_suppressed(rl);
+        rl->start = now;
+        rl->count = 0;
+    }
+
+    if (rl->count < RATELIMIT_BURST) {
+        ++rl->count;
+        r = 1;
+    } else {
+        ++rl->suppressed;
+    }
+    pthread_mutex_unlock(&ratelimits_lock);
+    return r;
+}
+
+/* A fork of the host (e.g. for the user's shell, keeping the PAM handle)
+ * while another thread holds ratelimits_lock would leave it locked for good in
+ * the child, hanging its first message: hold it across the fork, and start the
+ * child with a fresh one.
+ */
+static void
+ratelimits_prepare(void)
+{
+    pthread_mutex_lock(&ratelimits_lock);
+}
+
+static void
+ratelimits_parent(void)
+{
+    pthread_mutex_unlock(&ratelimits_lock);
+}
+
+static void
+ratelimits_child(void)
+{
+    pthread_mutex_init(&ratelimits_lock, NULL);
+}
+
+__attribute__((constructor)) static void
+init_ratelimits(void)
+{
+    pthread_atfork(ratelimits_prepare, ratelimits_parent, ratelimits_child);
+}
+
+/* Don't lose track of suppressed messages when the module goes away */
+__attribute__((destructor)) static void
+flush_ratelimits(void)
+{
+    int i;
+
+    pthread_mutex_lock(&ratelimits_lock);
+    for (i = 0; i < RATELIMIT_SLOTS; ++i)
+        if (ratelimits[i].key)
+            flush_suppressed(&ratelimits[i]);
+    pthread_mutex_unlock(&ratelimits_lock);
+}
+
+/* Log a message to syslog.
+ * No openlog()/closelog() here: that would reconnect to the syslog socket for
+ * every message, and mess with the application's own identity. Instead the
+ * connection of the process is used (opened on first use, and kept).
+ */
+static void
+log_vmsg(const struct rundir *rd, int priority, const char *format, va_list args)
+{
+    (void)rd;  /* Unused parameter */
+    char buf[1024];
+    int e = errno;  /* for %m */
+    
+    if (!ratelimit_allow(format, priority))
+        return;
+
+    errno = e;
+    vsnprintf(buf, sizeof(buf), format, args);
+    
+    /* Log to syslog with the PAM module name */
+    syslog(LOG_AUTHPRIV | priority, "pam_rundir: %s", buf);
+    
+    /* Also log to stderr if running in debug mode */
+#ifdef DEBUG
+    fprintf(stderr, "pam_rundir: %s\n", buf);
+#endif
+}
+
+/* Log an error message to syslog */
+static void
+log_error(const struct rundir *rd, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    log_vmsg(rd, LOG_ERR, format, args);
+    va_end(args);
+}
+
+/* Log an informational message to syslog */
+static void
+log_info(const struct rundir *rd, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    log_vmsg(rd, LOG_INFO, format, args);
+    va_end(args);
+}
+
+/* Log a debug message to syslog, if enabled with the debug option */
+static void
+log_debug(const struct rundir *rd, const char *format, ...)
+{
+    va_list args;
+
+    if (rd == NULL || !rd->opts.debug)
+        return;
+
+    va_start(args, format);
+    log_vmsg(rd, LOG_DEBUG, format, args);
+    va_end(args);
+}
+
+/* Set opts->dir from path, which must be absolute; trailing slashes are
+ * dropped. Returns 0 on success, -1 if path isn't valid. */
+static int
+set_dir(struct options *opts, const char *path)
+{
+    size_t l = strlen(path);
+
+    while (l > 1 && path[l - 1] == '/')
+        --l;
+    if (path[0] != '/' || l <= 1 || l > MAX_DIR_LEN)
+        return -1;
+    memcpy(opts->dir, path, l);
+    opts->dir[l] = '\0';
+    opts->dir_len = l;
+    return 0;
+}
+
+/* Set buf (MAX_VAR_LEN + 1) from name, which must be a valid variable name.
+ * Returns 0 on success, -1 if name isn't valid. */
+static int
+set_var_name(char *buf, const char *name)
+{
+    size_t i;
+
+    for (i = 0; name[i] != '\0'; ++i) {
+        if (i >= MAX_VAR_LEN || !(name[i] == '_'
+                    || (name[i] >= 'A' && name[i] <= 'Z')
+                    || (name[i] >= 'a' && name[i] <= 'z')
+                    || (i > 0 && name[i] >= '0' && name[i] <= '9')))
+            return -1;
+    }
+    if (i == 0)
+        return -1;
+    memcpy(buf, name, i + 1);
+    return 0;
+}
+
+/* Copy value into buf (MAX_TMPFS_VALUE + 1) if it's a valid tmpfs size, i.e.
+ * digits followed by an optional k, m or g suffix; or % when percent is set.
+ * Returns 0 on success, -1 if value isn't valid. */
+static int
+set_tmpfs_value(char *buf, const char *value, int percent)
+{
+    size_t l = strspn(value, "0123456789");
+
+    if (l == 0)
+        return -1;
+    if (value[l] != '\0' && (value[l + 1] != '\0'
+                || !strchr(percent ? "kKmMgG%" : "kKmMgG", value[l])))
+        return -1;
+    if (strlen(value) > MAX_TMPFS_VALUE)
+        return -1;
+    strcpy(buf, value);
+    return 0;
+}
+
+/* Add the extra directory of value, TEMPLATE:ENVVAR[:MODE], to opts. TEMPLATE
+ * is a name in the parent dir with one %u, not starting with a dot (counters
+ * and such) nor being the runtime dir's.
+ * Returns 0 on success, -1 if value isn't valid. */
+static int
+add_extra_dir(struct options *opts, const char *value)
+{
+    struct extra_dir *e = &opts->extra[opts->nb_extra];
+    const char *var = strchr(value, ':');
+    const char *mode, *u;
+    int digits = 1;
+    char *end;
+    size_t i, l;
+    long v;
+
+    if (opts->nb_extra == MAX_EXTRA_DIRS || var == NULL)
+        return -1;
+    l = var - value;
+    u = strstr(value, "%u");
+    if (u == NULL || u >= var || l > MAX_EXTRA_NAME || value[0] == '.'
+            || memchr(value, '/', l) || memchr(value, '%', l) != u
+            || memchr(u + 1, '%', var - u - 1))
+        return -1;
+    /* Names of uid only digits are other users' runtime dirs */
+    for (i = 0; i < l; ++i)
+        if (value + i != u && value + i != u + 1 && (value[i] < '0' || value[i] > '9'))
+            digits = 0;
+    if (digits)
+        return -1;
+    memcpy(e->template, value, l);
+    e->template[l] = '\0';
+    e->uid_at = u - value;
+
+    ++var;
+    e->mode = 0;
+    mode = strchr(var, ':');
+    if (mode != NULL) {
+        errno = 0;
+        v = strtol(mode + 1, &end, 8);
+        if (errno != 0 || end == mode + 1 || *end != '\0' || v <= 0 || v > 0777)
+            return -1;
+        e->mode = (mode_t) v | S_IRWXU;
+        l = mode - var;
+    } else {
+        l = strlen(var);
+    }
+    if (l > MAX_VAR_LEN)
+        return -1;
+    memcpy(e->var_name, var, l);
+    e->var_name[l] = '\0';
+    if (set_var_name(e->var_name, e->var_name) < 0)
+        return -1;
+
+    ++opts->nb_extra;
+    return 0;
+}
+
+/* Name of extra directory e of the user whose uid is name (the runtime dir's
+ * name) into buf (MAX_NAME_LEN + 1) */
+static const char *
+extra_name(const struct extra_dir *e, const char *name, char *buf)
+{
+    snprintf(buf, MAX_NAME_LEN + 1, "%.*s%.*s%s", (int) e->uid_at, e->template,
+             MAX_UID_LENGTH, name, e->template + e->uid_at + 2);
+    return buf;
+}
+
+/* Resolve group name to its gid. Returns 0 on success, -1 if not found. */
+static int
+lookup_group(const struct rundir *rd, const char *name, gid_t *gid)
+{
+    char stack_buf[PWBUF_SIZE];
+    char *buf = stack_buf;
+    size_t size = sizeof(stack_buf);
+    struct group grp;
+    struct group *gr = NULL;
+    int e;
+
+    while ((e = getgrnam_r(name, &grp, buf, size, &gr)) == ERANGE && size < PWBUF_MAX) {
+        char *p = realloc((buf == stack_buf) ? NULL : buf, size * 2);
+
+        if (!p) {
+            e = ENOMEM;
+            break;
+        }
+        buf = p;
+        size *= 2;
+    }
+    if (e != 0)
+        gr = NULL;
+    if (gr)
+        *gid = gr->gr_gid;
+    if (buf != stack_buf)
+        free(buf);
+    if (!gr) {
+        if (e == 0) {
+            log_error(rd, "Group %s not found in group database", name);
+        } else {
+            errno = e;
+            log_error(rd, "Failed to look up group %s: %m", name);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/* Add the patterns of value, KEY:PATTERN[,PATTERN]..., to rules. Returns 0
+ * on success, -1 if value isn't valid (then nothing is added). */
+static int
+add_rules(const struct rundir *rd, struct rules *rules, const char *value, int exclude)
+{
+    struct rules r = *rules;
+    const char *p = strchr(value, ':');
+    int key;
+
+    if (p == NULL)
+        return -1;
+    for (key = 0; key < NB_RULE_KEYS; ++key)
+        if (strlen(rule_keys[key]) == (size_t) (p - value)
+                && strncmp(value, rule_keys[key], p - value) == 0)
+            break;
+    if (key == NB_RULE_KEYS)
+        return -1;
+
+    do {
+        size_t l;
+
+        ++p;
+        l = strcspn(p, ",");
+        if (l == 0 || r.count == MAX_RULES || r.len + l + 1 > sizeof(r.buf))
+            return -1;
+        r.rule[r.count].key = key;
+        r.rule[r.count].exclude = exclude;
+        r.rule[r.count].pattern = r.len;
+        memcpy(r.buf + r.len, p, l);
+        r.buf[r.len + l] = '\0';
+        if (key == RULE_GROUP && lookup_group(rd, r.buf + r.len, &r.rule[r.count].gid) < 0)
+            return -1;
+        r.len += l + 1;
+        ++r.count;
+        if (!exclude)
+            ++r.includes;
+        p += l;
+    } while (*p == ',');
+
+    *rules = r;
+    return 0;
+}
+
+/* Parse module arguments; unknown ones are ignored */
+static void
+parse_options(const struct rundir *rd, int argc, const char **argv,
+              struct options *opts)
+{
+    mode_t umask_value = DEFAULT_UMASK;
+    int i;
+
+    opts->debug = 0;
+    set_dir(opts, PARENT_DIR);
+    set_var_name(opts->var_name, VAR_NAME);
+    opts->lock_timeout = LOCK_TIMEOUT;
+    opts->nss_cache = 0;
+    opts->defer_cleanup = 0;
+    opts->linger = 0;
+    opts->table = 0;
+    opts->timing = 0;
+    opts->uring = 0;
+    opts->reaper_threads = 1;
+    strcpy(opts->reaper, REAPER_PATH);
+    opts->registry = 0;
+    opts->trace = 0;
+    opts->pool = 0;
+    opts->skel[0] = '\0';
+    opts->usage = 0;
+    opts->tmpfs = 0;
+    opts->tmpfs_size[0] = '\0';
+    opts->tmpfs_nr_inodes[0] = '\0';
+    opts->rules.count = 0;
+    opts->rules.includes = 0;
+    opts->rules.len = 0;
+    opts->nb_extra = 0;
+
+    for (i = 0; i < argc; ++i) {
+        long *value;
+        const char *arg;
+        char *end;
+        long v;
+
+        if (strcmp(argv[i], "debug") == 0) {
+            opts->debug = 1;
+            continue;
+        } else if (strncmp(argv[i], "umask=", 6) == 0) {
+            errno = 0;
+            v = strtol(argv[i] + 6, &end, 8);
+            if (errno != 0 || end == argv[i] + 6 || *end != '\0' || v < 0 || v > 0777)
+                log_error(rd, "Invalid value for option: %s", argv[i]);
+            else
+                umask_value = (mode_t) v;
+            continue;
+        } else if (strncmp(argv[i], "dir=", 4) == 0) {
+            if (set_dir(opts, argv[i] + 4) < 0)
+                log_error(rd, "Invalid value for option: %s", argv[i]);
+            continue;
+        } else if (strncmp(argv[i], "envvar=", 7) == 0) {
+            if (set_var_name(opts->var_name, argv[i] + 7) < 0)
+                log_error(rd, "Invalid value for option: %s", argv[i]);
+            continue;
+        } else if (strncmp(argv[i], "teardown=", 9) == 0) {
+            if (strcmp(argv[i] + 9, "uring") == 0)
+                opts->uring = 1;
+            else if (strcmp(argv[i] + 9, "sync") == 0)
+                opts->uring = 0;
+            else
+                log_error(rd, "Invalid value for option: %s", argv[i]);
+            continue;
+        } else if (strcmp(argv[i], "timing") == 0) {
+            opts->timing = 1;
+            continue;
+        } else if (strcmp(argv[i], "tmpfs") == 0) {
+            opts->tmpfs = 1;
+            continue;
+        } else if (strncmp(argv[i], "tmpfs_size=", 11) == 0) {
+            if (set_tmpfs_value(opts->tmpfs_size, argv[i] + 11, 1) < 0)
+                log_error(rd, "Invalid value for option: %s", argv[i]);
+            continue;
+        } else if (strncmp(argv[i], "tmpfs_nr_inodes=", 16) == 0) {
+            if (set_tmpfs_value(opts->tmpfs_nr_inodes, argv[i] + 16, 0) < 0)
+                log_error(rd, "Invalid value for option: %s", argv[i]);
+            continue;
+        } else if (strncmp(argv[i], "include=", 8) == 0 || strncmp(argv[i], "exclude=", 8) == 0) {
+            if (add_rules(rd, &opts->rules, argv[i] + 8, argv[i][0] == 'e') < 0)
+                log_error(rd, "Invalid value for option: %s", argv[i]);
+            continue;
+        } else if (strncmp(argv[i], "skel=", 5) == 0) {
+            if (argv[i][5] != '/' || strlen(argv[i] + 5) > MAX_DIR_LEN)
+                log_error(rd, "Invalid value for option: %s", argv[i]);
+            else
+                strcpy(opts->skel, argv[i] + 5);
+            continue;
+        } else if (strncmp(argv[i], "reaper=", 7) == 0) {
+            if (argv[i][7] != '/' || strlen(argv[i] + 7) > MAX_DIR_LEN)
+                log_error(rd, "Invalid value for option: %s", argv[i]);
+            else
+                strcpy(opts->reaper, argv[i] + 7);
+            continue;
+        } else if (strncmp(argv[i], "extra_dir=", 10) == 0) {
+            if (add_extra_dir(opts, argv[i] + 10) < 0)
+                log_error(rd, "Invalid value for option: %s", argv[i]);
+            continue;
+        } else if (strcmp(argv[i], "defer_cleanup") == 0) {
+            opts->defer_cleanup = 1;
+            continue;
+        } else if (strcmp(argv[i], "registry") == 0) {
+            opts->registry = 1;
+            continue;
+        } else if (strncmp(argv[i], "counters=", 9) == 0) {
+            if (strcmp(argv[i] + 9, "table") == 0)
+                opts->table = 1;
+            else if (strcmp(argv[i] + 9, "files") == 0)
+                opts->table = 0;
+            else
+                log_error(rd, "Invalid value for option: %s", argv[i]);
+            continue;
+        } else if (strncmp(argv[i], "lock_timeout=", 13) == 0) {
+            value = &opts->lock_timeout;
+            arg = argv[i] + 13;
+        } else if (strncmp(argv[i], "nss_cache=", 10) == 0) {
+            value = &opts->nss_cache;
+            arg = argv[i] + 10;
+        } else if (strncmp(argv[i], "linger=", 7) == 0) {
+            value = &opts->linger;
+            arg = argv[i] + 7;
+        } else if (strncmp(argv[i], "reaper_threads=", 15) == 0) {
+            value = &opts->reaper_threads;
+            arg = argv[i] + 15;
+        } else if (strncmp(argv[i], "trace=", 6) == 0) {
+            value = &opts->trace;
+            arg = argv[i] + 6;
+        } else if (strncmp(argv[i], "pool=", 5) == 0) {
+            value = &opts->pool;
+            arg = argv[i] + 5;
+        } else if (strncmp(argv[i], "usage=", 6) == 0) {
+            value = &opts->usage;
+            arg = argv[i] + 6;
+        } else {
+            continue;
+        }
+
+        errno = 0;
+        v = strtol(arg, &end, 10);
+        if (errno != 0 || end == arg || *end != '\0' || v < 0) {
+            log_error(rd, "Invalid value for option: %s", argv[i]);
+            continue;
+        }
+        *value = v;
+    }
+
+    if (opts->registry && opts->table) {
+        log_error(rd, "Option registry needs counters=files, ignored");
+        opts->registry = 0;
+    }
+
+    if (opts->reaper_threads < 1)
+        opts->reaper_threads = 1;
+    else if (opts->reaper_threads > MAX_REAPER_THREADS)
+        opts->reaper_threads = MAX_REAPER_THREADS;
+    if (opts->trace > MAX_TRACE_RECORDS)
+        opts->trace = MAX_TRACE_RECORDS;
+    if (opts->pool > MAX_POOL)
+        opts->pool = MAX_POOL;
+    if (opts->usage > MAX_USAGE)
+        opts->usage = MAX_USAGE;
+    if (opts->pool > 0 && opts->tmpfs) {
+        log_error(rd, "Option pool doesn't apply with tmpfs, ignored");
+        opts->pool = 0;
+    }
+
+    /* The user always keeps full access to their runtime dir */
+    opts->mode = (0777 & ~umask_value) | S_IRWXU;
+    for (i = 0; i < opts->nb_extra; ++i)
+        if (opts->extra[i].mode == 0)
+            opts->extra[i].mode = opts->mode;
+}
+
+/* Command line of the reaper: reaper= in its mode of only reaping the trash
+ * and filling the pool, with the same threads and options. Allocated once, so
+ * the reaper's process doesn't have to. Returns NULL on error. */
+static char **
+reaper_argv(const struct options *opts, int argc, const char **argv)
+{
+    char threads[MAX_UID_LENGTH + 2];
+    const char *head[] = { opts->reaper, "-r", "-j", threads, "--" };
+    const int nb_head = sizeof(head) / sizeof(*head);
+    size_t size = (nb_head + argc + 1) * sizeof(char *);
+    char **v;
+    char *p;
+    int i;
+
+    snprintf(threads, sizeof(threads), "%ld", opts->reaper_threads);
+    for (i = 0; i < nb_head; ++i)
+        size += strlen(head[i]) + 1;
+    for (i = 0; i < argc; ++i)
+        size += strlen(argv[i]) + 1;
+    v = malloc(size);
+    if (v == NULL)
+        return NULL;
+
+    p = (char *) (v + nb_head + argc + 1);
+    for (i = 0; i < nb_head + argc; ++i) {
+        const char *arg = (i < nb_head) ? head[i] : argv[i - nb_head];
+
+        v[i] = strcpy(p, arg);
+        p += strlen(arg) + 1;
+    }
+    v[i] = NULL;
+    return v;
+}
+
+struct rundir *
+rundir_new(int argc, const char **argv)
+{
+    struct rundir *rd = malloc(sizeof(*rd));
+
+    if (rd == NULL) {
+        log_error(NULL, "Failed to allocate memory for options");
+        return NULL;
+    }
+    parse_options(rd, argc, argv, &rd->opts);
+    rd->reaper_argv = reaper_argv(&rd->opts, argc, argv);
+    if (rd->reaper_argv == NULL) {
+        log_error(rd, "Failed to allocate memory for options");
+        free(rd);
+        return NULL;
+    }
+    return rd;
+}
+
+void
+rundir_free(struct rundir *rd)
+{
+    if (rd == NULL)
+        return;
+    free(rd->reaper_argv);
+    free(rd);
+}
+
+static long
+elapsed_us(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L
+        + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* Start timing a session, if enabled (by timing, or trace=) */
+static void
+timing_begin(const struct options *opts)
+{
+    memset(&timing, 0, sizeof(timing));
+    timing.uid = (uid_t) -1;            /* Until known */
+    timing.enabled = opts->timing || opts->trace > 0;
+    if (timing.enabled)
+        clock_gettime(CLOCK_MONOTONIC, &timing.start);
+    if (opts->trace > 0)
+        clock_gettime(CLOCK_REALTIME, &timing.wall);
+}
+
+static void
+phase_start(struct timespec *ts)
+{
+    if (timing.enabled)
+        clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static void
+phase_end(enum phase phase, const struct timespec *ts)
+{
+    if (timing.enabled) {
+        timing.us[phase] += elapsed_us(ts);
+        timing.done |= 1U << phase;
+    }
+}
+
+/* Map the trace ring, creating it with opts->trace records if needed; an
+ * existing one keeps its size. Returns NULL on error, else the header, with
+ * size set to the size of the mapping.
+ */
+static struct trace_header *
+trace_map(const struct options *opts, size_t *size)
+{
+    char file[MAX_PATH_LEN];
+    struct trace_header *hdr;
+    struct stat st;
+    int fd;
+
+    *size = sizeof(*hdr) + (size_t) opts->trace * sizeof(struct trace_record);
+    do { fd = open(parent_path(opts, file, TRACE_NAME), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH); }
+    while (fd < 0 && errno == EINTR);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0 || ((size_t) st.st_size < *size && ftruncate(fd, *size) < 0)) {
+        close(fd);
+        return NULL;
+    }
+    if ((size_t) st.st_size > *size)
+        *size = st.st_size;
+
+    hdr = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED)
+        return NULL;
+
+    /* Concurrent initializations write the same thing, so that's fine */
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != TRACE_MAGIC) {
+        hdr->version = TRACE_VERSION;
+        hdr->records = (uint32_t) opts->trace;
+        hdr->record_size = sizeof(struct trace_record);
+        __atomic_store_n(&hdr->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+    }
+    if (hdr->version != TRACE_VERSION || hdr->record_size != sizeof(struct trace_record)
+            || hdr->records == 0
+            || sizeof(*hdr) + (size_t) hdr->records * sizeof(struct trace_record) > *size) {
+        munmap(hdr, *size);
+        return NULL;
+    }
+    return hdr;
+}
+
+/* A trace id for a new session: the pid, and a hash of the time and a
+ * sequence number. The module can be loaded anew for each session (and the
+ * sequence restart), hence the time. */
+static uint64_t
+new_trace_id(void)
+{
+    struct { struct timespec ts; uint32_t n; } seed;
+
+    memset(&seed, 0, sizeof(seed));
+    seed.ts = timing.wall;
+    seed.n = __atomic_add_fetch(&trace_ids, 1, __ATOMIC_RELAXED);
+    return ((uint64_t) getpid() << 32) | fnv1a(&seed, sizeof(seed));
+}
+
+/* Append the record of the operation just timed to the trace ring. Errors
+ * are ignored. */
+static void
+trace_add(const struct options *opts, int op, int r, long total_us)
+{
+    struct trace_header *hdr;
+    struct trace_record *rec;
+    uint64_t idx;
+    size_t size;
+    int i;
+
+    hdr = trace_map(opts, &size);
+    if (hdr == NULL)
+        return;
+
+    idx = __atomic_fetch_add(&hdr->next, 1, __ATOMIC_RELAXED);
+    rec = (struct trace_record *) (hdr + 1) + idx % hdr->records;
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELEASE);
+    rec->time_ns = (int64_t) timing.wall.tv_sec * 1000000000 + timing.wall.tv_nsec;
+    rec->session = timing.session;
+    rec->uid = (uint32_t) timing.uid;
+    rec->gid = (uint32_t) timing.gid;
+    rec->pid = (uint32_t) getpid();
+    rec->op = (uint8_t) op;
+    rec->result = (int8_t) r;
+    rec->pad = 0;
+    rec->total_us = (uint32_t) total_us;
+    for (i = 0; i < NB_PHASES; ++i)
+        rec->us[i] = (uint32_t) timing.us[i];
+    rec->entries = (uint32_t) timing.entries;
+    __atomic_store_n(&rec->seq, idx + 1, __ATOMIC_RELEASE);
+
+    munmap(hdr, size);
+}
+
+/* Done timing a session (op being "open" or "close", which returned r): add
+ * it to the trace, and with timing log it all as one line of key=value fields,
+ * and add it to the statistics. The line isn't subject to ratelimiting.
+ */
+static void
+timing_end(const struct options *opts, const char *op, int r)
+{
+    char buf[64 * NB_PHASES];
+    uint64_t *counters;
+    long total_us;
+    int l = 0;
+    int i;
+
+    if (!timing.enabled)
+        return;
+    timing.enabled = 0;
+    total_us = elapsed_us(&timing.start);
+
+    if (opts->trace > 0)
+        trace_add(opts, (*op == 'o') ? TRACE_OPEN : TRACE_CLOSE, r, total_us);
+    if (!opts->timing)
+        return;
+
+    for (i = 0; i < NB_PHASES; ++i)
+        l += snprintf(buf + l, sizeof(buf) - l, " %s_us=%ld", phase_names[i], timing.us[i]);
+    if (opts->usage > 0)
+        snprintf(buf + l, sizeof(buf) - l, " entries=%lu bytes=%llu",
+                 timing.entries, (unsigned long long) timing.bytes);
+    else
+        snprintf(buf + l, sizeof(buf) - l, " entries=%lu", timing.entries);
+    syslog(LOG_AUTHPRIV | LOG_INFO, "pam_rundir: op=%s uid=%d status=%d total_us=%ld%s",
+           op, (int) timing.uid, r, total_us, buf);
+
+    counters = stats_map(opts);
+    if (counters == NULL)
+        return;
+    if (r == RUNDIR_OK)
+        __atomic_add_fetch(&counters[(*op == 'o') ? STAT_SESSIONS_OPENED : STAT_SESSIONS_CLOSED],
+                           1, __ATOMIC_RELAXED);
+    if (timing.done & (1U << PHASE_LOCK)) {
+        __atomic_add_fetch(&counters[STAT_LOCKS], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&counters[STAT_LOCK_US], timing.us[PHASE_LOCK], __ATOMIC_RELAXED);
+        stats_hist(counters, STAT_LOCK_HIST, timing.us[PHASE_LOCK]);
+    }
+    if (timing.done & (1U << PHASE_TEARDOWN)) {
+        __atomic_add_fetch(&counters[STAT_TEARDOWNS], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&counters[STAT_TEARDOWN_US], timing.us[PHASE_TEARDOWN], __ATOMIC_RELAXED);
+        __atomic_add_fetch(&counters[STAT_ENTRIES_REMOVED], timing.entries, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&counters[STAT_BYTES_REMOVED], timing.bytes, __ATOMIC_RELAXED);
+        stats_hist(counters, STAT_TEARDOWN_HIST, timing.us[PHASE_TEARDOWN]);
+    }
+    stats_unmap(counters);
+}
+
+/* A blocking wait for a lock, in the helper thread of lock_wait() */
+struct lock_waiter {
+    int fd;
+    struct flock *range;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int done;                      /* Under mutex, with r and err */
+    int r;
+    int err;
+};
+
+static void *
+lock_waiter_run(void *data)
+{
+    struct lock_waiter *w = data;
+    int r, e;
+
+    /* Cancelled right away at the deadline, even while blocked in flock(),
+     * which isn't a cancellation point; nothing to clean up until it returns */
+    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+    do { r = w->range ? fcntl(w->fd, F_OFD_SETLKW, w->range) : flock(w->fd, LOCK_EX); }
+    while (r < 0 && errno == EINTR);
+    e = errno;
+    pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+
+    pthread_mutex_lock(&w->mutex);
+    w->done = 1;
+    w->r = r;
+    w->err = e;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->mutex);
+    return NULL;
+}
+
+/* Wait for an exclusive lock on fd for at most timeout milliseconds: on the
+ * whole file (flock), or if range isn't NULL on that range (OFD lock).
+ * No signal of the process is involved, as its SIGALRM (or any other) belongs to
+ * the host application and a handler can't be shared safely between threads:
+ * a helper thread, with all signals blocked, blocks on the lock while we wait
+ * for it until the deadline, and is cancelled past it. Both kinds of locks
+ * belong to the open file description, so one the helper got just before
+ * being cancelled is ours, which a last attempt finds out.
+ * Returns 0 on success, -1 with errno set (EWOULDBLOCK on timeout).
+ */
+static int
+lock_wait(int fd, struct flock *range, long timeout)
+{
+    struct lock_waiter w = { .fd = fd, .range = range };
+    struct timespec deadline;
+    pthread_condattr_t cattr;
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t all, old;
+    int done = 0;
+    int r = -1;
+    int e;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_init(&w.mutex, NULL);
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w.cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, (PTHREAD_STACK_MIN > LOCK_WAIT_STACK)
+                              ? PTHREAD_STACK_MIN : LOCK_WAIT_STACK);
+    /* The thread starts with all signals blocked, leaving them to the host's */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    e = pthread_create(&thread, &attr, lock_waiter_run, &w);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    if (e != 0) {
+        errno = e;
+        goto cleanup;
+    }
+
+    pthread_mutex_lock(&w.mutex);
+    for (e = 0; !w.done && e != ETIMEDOUT; )
+        e = pthread_cond_timedwait(&w.cond, &w.mutex, &deadline);
+    done = w.done;
+    pthread_mutex_unlock(&w.mutex);
+    if (!done)
+        pthread_cancel(thread);
+    pthread_join(thread, NULL);
+
+    if (done) {
+        r = w.r;
+        errno = w.err;
+    } else {
+        r = range ? fcntl(fd, F_OFD_SETLK, range) : flock(fd, LOCK_EX | LOCK_NB);
+        if (r < 0 && (errno == EACCES || errno == EINTR))
+            errno = EWOULDBLOCK;
+    }
+
+cleanup:
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.mutex);
+    return r;
+}
+
+/* Take an exclusive lock on fd (or range of it, see lock_wait()), waiting up
+ * to the configured deadline. Time spent waiting on a contended lock is logged.
+ * what is the name of the locked object, for messages.
+ */
+static int
+lock_fd (int fd, struct flock *range, const char *what, const struct rundir *rd,
+         const struct options *opts)
+{
+    struct timespec start;
+    int r;
+
+    /* Uncontended case: no waiting needed */
+    r = range ? fcntl(fd, F_OFD_SETLK, range) : flock(fd, LOCK_EX | LOCK_NB);
+    if (r == 0) {
+        return 0;
+    }
+    if (errno != EWOULDBLOCK && errno != EACCES && errno != EINTR) {
+        if (rd) log_error(rd, "Failed to lock %s: %m", what);
+        return -1;
+    }
+
+    if (opts->lock_timeout > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (lock_wait(fd, range, opts->lock_timeout) == 0) {
+            long us = elapsed_us(&start);
+
+            if (rd) log_info(rd, "Waited %ld.%03ld ms for lock on %s",
+                               us / 1000, us % 1000, what);
+            return 0;
+        }
+        if (errno != EWOULDBLOCK) {
+            if (rd) log_error(rd, "Failed to lock %s: %m", what);
+            return -1;
+        }
+    }
+
+    if (rd) log_error(rd, "Failed to lock %s within %ld ms", what, opts->lock_timeout);
+    return -1;
+}
+
+/* Safely open and lock a file, waiting up to the configured deadline. With a
+ * parentfd, it is opened relative to it (the parent dir), else by path.
+ */
+static int
+open_and_lock (int parentfd, const char *file, const struct rundir *rd, const struct options *opts)
+{
+    const char *name = (parentfd == AT_FDCWD) ? file : strrchr(file, '/') + 1;
+    int fd;
+
+    do { fd = openat(parentfd, name, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+                     S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH); }
+    while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+        if (rd) log_error(rd, "Failed to open %s: %m", file);
+        return -1;
+    }
+
+    if (lock_fd(fd, NULL, file, rd, opts) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static inline void
+print_filename (const struct options *opts, char *s, int uid, int l)
+{
+    /* construct file name, e.g: "/run/users/.1000" */
+    memcpy (s, opts->dir, opts->dir_len);
+    s[opts->dir_len] = '/';
+    s[opts->dir_len + 1] = '.';
+    print_int (s + opts->dir_len + 2, uid, l);
+    s[opts->dir_len + 2 + l] = '\0';
+
+}
+
+/* FNV-1a, used to pick passwd cache slots, and as checksum of records */
+static uint32_t
+fnv1a(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint32_t h = 2166136261u;
+
+    while (len-- > 0) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Counters are stored as a fixed-size record, read and written in a single
+ * syscall, at offset 0. Files in the older format, the counter as ASCII string
+ * (or "-" for a directory not usable), are still understood, and converted on
+ * next write.
+ */
+static int
+read_counter (int fd)
+{
+    union {
+        struct counter_record rec;
+        char ascii[MAX_UID_LENGTH + 2];
+    } buf;
+    int count = 0;
+    int p;
+    ssize_t r;
+
+    do { r = pread (fd, &buf, sizeof (buf), 0); }
+    while (r < 0 && errno == EINTR);
+    if (r < 0)
+        return -1;
+
+    if (r == sizeof (buf.rec) && buf.rec.magic == COUNTER_MAGIC)
+    {
+        if (buf.rec.version != COUNTER_VERSION
+                || buf.rec.check != fnv1a (&buf.rec, offsetof (struct counter_record, check))
+                || buf.rec.count > INT_MAX)
+            return -1;
+        if (buf.rec.flags & COUNTER_UNUSABLE)
+            /* special case: dir not usable, but not a failure */
+            return -2;
+        return (int) buf.rec.count;
+    }
+
+    /* ASCII format */
+    if (r == 1 && buf.ascii[0] == '-')
+        /* special case: dir not usable, but not a failure */
+        return -2;
+    if (r > MAX_UID_LENGTH)
+        return -1;
+    for (p = 0; p < r; ++p)
+    {
+        if (buf.ascii[p] < '0' || buf.ascii[p] > '9')
+            return -1;
+        count *= 10;
+        count += buf.ascii[p] - '0';
+    }
+    return count;
+}
+
+/* count < 0 marks the dir as not usable */
+static int
+write_counter (int fd, int count)
+{
+    struct counter_record rec;
+    ssize_t r;
+
+    memset (&rec, 0, sizeof (rec));
+    rec.magic = COUNTER_MAGIC;
+    rec.version = COUNTER_VERSION;
+    if (count >= 0)
+        rec.count = count;
+    else
+        rec.flags = COUNTER_UNUSABLE;
+    rec.check = fnv1a (&rec, offsetof (struct counter_record, check));
+
+    /* The record is never shorter than an ASCII counter, so there's never
+     * anything left to truncate after it */
+    do { r = pwrite (fd, &rec, sizeof (rec), 0); }
+    while (r < 0 && errno == EINTR);
+
+    /* A short write leaves a record with a bad checksum, which is invalid */
+    return (r == sizeof (rec)) ? 0 : -1;
+}
+
+/* Start time of process pid, in clock ticks since boot (field 22 of its stat
+ * in /proc). Returns 0 if it can't be told, with errno ENOENT if there's no
+ * such process, or it's a zombie (dead, but not reaped yet). */
+static uint64_t
+process_start(pid_t pid)
+{
+    char path[32];
+    char buf[512];
+    const char *p;
+    ssize_t r;
+    int fd;
+    int i;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    do { r = read(fd, buf, sizeof(buf) - 1); }
+    while (r < 0 && errno == EINTR);
+    close(fd);
+    if (r <= 0) {
+        errno = EIO;
+        return 0;
+    }
+    buf[r] = '\0';
+
+    /* The command name (field 2) can contain anything, up to the last ')' */
+    p = strrchr(buf, ')');
+    if (p != NULL && p[1] == ' ' && (p[2] == 'Z' || p[2] == 'X')) {
+        errno = ENOENT;
+        return 0;
+    }
+    for (i = 0; p != NULL && i < 20; ++i)
+        p = strchr(p + 1, ' ');
+    if (p == NULL) {
+        errno = EIO;
+        return 0;
+    }
+    return strtoull(p + 1, NULL, 10);
+}
+
+/* Whether the process of registry entry e is still around: pidfd_open() tells
+ * dead ones without going through /proc, the start time tells a reused pid.
+ * When it can't be told, it's assumed to be. */
+static int
+process_alive(const struct registry_entry *e)
+{
+    uint64_t start;
+
+#ifdef SYS_pidfd_open
+    int fd = syscall(SYS_pidfd_open, (pid_t) e->pid, 0);
+    if (fd >= 0)
+        close(fd);
+    else if (errno == ESRCH)
+        return 0;
+#endif
+    start = process_start(e->pid);
+    if (start == 0)
+        return errno != ENOENT;
+    return e->start == 0 || start == e->start;
+}
+
+/* Read the registry of counter file fd into e (REGISTRY_MAX entries).
+ * Returns the number of entries, or -1 on error. */
+static int
+registry_read(int fd, struct registry_entry *e)
+{
+    ssize_t r;
+
+    do { r = pread(fd, e, REGISTRY_MAX * sizeof(*e), sizeof(struct counter_record)); }
+    while (r < 0 && errno == EINTR);
+    return (r < 0) ? -1 : (int) (r / sizeof(*e));
+}
+
+static int
+registry_write(int fd, const struct registry_entry *e, int i)
+{
+    ssize_t r;
+
+    do { r = pwrite(fd, e, sizeof(*e), sizeof(struct counter_record) + i * sizeof(*e)); }
+    while (r < 0 && errno == EINTR);
+    return (r == sizeof(*e)) ? 0 : -1;
+}
+
+/* Drop dead sessions from the registry of the (locked) counter file fd, and
+ * from its counter, count. Returns the new count, or -1 on error.
+ */
+static int
+registry_prune(const struct rundir *rd, int fd, uid_t uid, int count)
+{
+    static const struct registry_entry unused;
+    struct registry_entry *e;
+    int dead = 0;
+    int n;
+    int i;
+
+    e = malloc(REGISTRY_MAX * sizeof(*e));
+    if (e == NULL)
+        return count;
+    n = registry_read(fd, e);
+    for (i = 0; i < n; ++i) {
+        if (e[i].pid != 0 && !process_alive(&e[i]) && registry_write(fd, &unused, i) == 0)
+            ++dead;
+    }
+    free(e);
+
+    if (dead > 0) {
+        count = (count > dead) ? count - dead : 0;
+        if (write_counter(fd, count) < 0)
+            return -1;
+        log_info(rd, "Pruned %d dead session(s) of uid %d", dead, (int) uid);
+    }
+    return count;
+}
+
+/* Add session s to the registry of the (locked) counter file fd. Returns 0 on
+ * success, -1 if it couldn't be (e.g. full). */
+static int
+registry_add(int fd, const struct rundir_session *s)
+{
+    struct registry_entry entry = { (uint32_t) s->pid, 0, s->start };
+    struct registry_entry *e;
+    int n;
+    int i;
+
+    e = malloc(REGISTRY_MAX * sizeof(*e));
+    if (e == NULL)
+        return -1;
+    n = registry_read(fd, e);
+    for (i = 0; i < n && e[i].pid != 0; ++i)
+        ;
+    free(e);
+    if (n < 0 || i >= REGISTRY_MAX)
+        return -1;
+    return registry_write(fd, &entry, i);
+}
+
+/* Remove session s from the registry of the (locked) counter file fd.
+ * Returns 1 if it was removed, 0 if it wasn't there (pruned), -1 on error.
+ */
+static int
+registry_remove(int fd, const struct rundir_session *s)
+{
+    static const struct registry_entry unused;
+    struct registry_entry *e;
+    int r = 0;
+    int n;
+    int i;
+
+    e = malloc(REGISTRY_MAX * sizeof(*e));
+    if (e == NULL)
+        return -1;
+    n = registry_read(fd, e);
+    if (n < 0)
+        r = -1;
+    for (i = 0; i < n; ++i) {
+        if (e[i].pid == (uint32_t) s->pid && e[i].start == s->start) {
+            r = (registry_write(fd, &unused, i) == 0) ? 1 : -1;
+            break;
+        }
+    }
+    free(e);
+    return r;
+}
+
+/* Empty the registry of counter file fd, when starting afresh */
+static void
+registry_reset(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == 0 && st.st_size > (off_t) sizeof(struct counter_record))
+        ftruncate(fd, sizeof(struct counter_record));
+}
+
+static int
+open_pwcache(const struct options *opts, int flags)
+{
+    char file[MAX_PATH_LEN];
+    int fd;
+
+    do { fd = open(parent_path(opts, file, PWCACHE_NAME), flags | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR); }
+    while (fd < 0 && errno == EINTR);
+    return fd;
+}
+
+/* The window of PWCACHE_PROBES slots where name may be stored */
+static off_t
+pwcache_window(const char *name, size_t len)
+{
+    return (off_t)(fnv1a(name, len) % (PWCACHE_SLOTS - PWCACHE_PROBES + 1))
+        * sizeof(struct pwcache_entry);
+}
+
+/* Look name up in the passwd cache; entries older than nss_cache seconds are
+ * ignored. Entries are checksummed, so a torn or garbage entry is just a miss.
+ * Returns 1 when found, else 0.
+ */
+static int
+pwcache_get(const struct options *opts, const char *name, uid_t *uid, gid_t *gid)
+{
+    struct pwcache_entry e[PWCACHE_PROBES];
+    size_t len = strlen(name);
+    time_t now = time(NULL);
+    ssize_t r;
+    int fd;
+    int i;
+
+    if (len >= sizeof(e[0].name))
+        return 0;
+
+    fd = open_pwcache(opts, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    do { r = pread(fd, e, sizeof(e), pwcache_window(name, len)); }
+    while (r < 0 && errno == EINTR);
+    close(fd);
+
+    for (i = 0; r > 0 && i < (int)(r / sizeof(e[0])); ++i) {
+        if (memcmp(e[i].name, name, len + 1) != 0
+                || e[i].check != fnv1a(&e[i], offsetof(struct pwcache_entry, check))
+                || e[i].stamp > now || now - e[i].stamp >= opts->nss_cache)
+            continue;
+        *uid = e[i].uid;
+        *gid = e[i].gid;
+        return 1;
+    }
+    return 0;
+}
+
+/* Store name in the passwd cache, replacing an entry for the same name, else
+ * the oldest one in its window. Failures are silently ignored.
+ */
+static void
+pwcache_put(const struct options *opts, const char *name, uid_t uid, gid_t gid)
+{
+    struct pwcache_entry e[PWCACHE_PROBES];
+    struct pwcache_entry entry;
+    size_t len = strlen(name);
+    off_t off;
+    ssize_t r;
+    int fd;
+    int i, n, pick = 0;
+
+    if (len >= sizeof(entry.name))
+        return;
+
+    fd = open_pwcache(opts, O_RDWR | O_CREAT);
+    if (fd < 0)
+        return;
+
+    off = pwcache_window(name, len);
+    do { r = pread(fd, e, sizeof(e), off); }
+    while (r < 0 && errno == EINTR);
+    n = (r > 0) ? (int)(r / sizeof(e[0])) : 0;
+
+    /* Unused slots are past the end of file, or zeroed (hence oldest) */
+    for (i = 0; i < n; ++i) {
+        if (memcmp(e[i].name, name, len + 1) == 0)
+            break;
+        if (e[i].stamp < e[pick].stamp)
+            pick = i;
+    }
+    if (i < n || n < PWCACHE_PROBES)
+        pick = i;
+
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.name, name, len);
+    entry.uid = uid;
+    entry.gid = gid;
+    entry.stamp = time(NULL);
+    entry.check = fnv1a(&entry, offsetof(struct pwcache_entry, check));
+
+    do { r = pwrite(fd, &entry, sizeof(entry), off + pick * sizeof(entry)); }
+    while (r < 0 && errno == EINTR);
+    close(fd);
+}
+
+/* Resolve user to uid/gid, through the passwd cache if enabled. Reentrant,
+ * the buffer is on the stack, or grown on the heap for huge entries.
+ */
+static int
+lookup_user(const struct rundir *rd, const struct options *opts, const char *user,
+            uid_t *uid, gid_t *gid)
+{
+    char stack_buf[PWBUF_SIZE];
+    char *buf = stack_buf;
+    size_t size = sizeof(stack_buf);
+    struct passwd pwd;
+    struct passwd *pw = NULL;
+    int e;
+
+    if (opts->nss_cache > 0 && pwcache_get(opts, user, uid, gid))
+        return 0;
+
+    PROBE1(nss_start, user);
+    while ((e = getpwnam_r(user, &pwd, buf, size, &pw)) == ERANGE && size < PWBUF_MAX) {
+        char *p = realloc((buf == stack_buf) ? NULL : buf, size * 2);
+
+        if (!p) {
+            e = ENOMEM;
+            break;
+        }
+        buf = p;
+        size *= 2;
+    }
+    if (e != 0)
+        pw = NULL;
+    PROBE2(nss_end, user, pw ? (int) pw->pw_uid : -1);
+    if (!pw) {
+        if (buf != stack_buf)
+            free(buf);
+        if (e == 0) {
+            log_error(rd, "User %s not found in passwd database", user);
+        } else {
+            errno = e;
+            log_error(rd, "Failed to look up user %s: %m", user);
+        }
+        return -1;
+    }
+    *uid = pw->pw_uid;
+    *gid = pw->pw_gid;
+    if (buf != stack_buf)
+        free(buf);
+
+    if (opts->nss_cache > 0)
+        pwcache_put(opts, user, *uid, *gid);
+    return 0;
+}
+
+/* Map the shared counter table, creating it if needed; fd is set to the open
+ * table, which the caller must close (after munmap()) */
+static struct table_header *
+table_map(const struct options *opts, int parentfd, const struct rundir *rd, int *fd,
+          struct stat *st)
+{
+    const size_t size = (TABLE_SLOTS + 1) * sizeof(struct table_slot);
+    char file[MAX_PATH_LEN];
+    struct table_header *hdr;
+
+    parent_path(opts, file, TABLE_NAME);
+    do { *fd = openat(parentfd, (parentfd == AT_FDCWD) ? file : TABLE_NAME,
+                      O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+                      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH); }
+    while (*fd < 0 && errno == EINTR);
+    if (*fd < 0) {
+        if (rd) log_error(rd, "Failed to open %s: %m", file);
+        return NULL;
+    }
+
+    /* A new table is all zeroes, i.e. all slots free */
+    if (fstat(*fd, st) < 0 || ((size_t) st->st_size < size && ftruncate(*fd, size) < 0)) {
+        if (rd) log_error(rd, "Failed to size %s: %m", file);
+        close(*fd);
+        return NULL;
+    }
+
+    hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (hdr == MAP_FAILED) {
+        if (rd) log_error(rd, "Failed to map %s: %m", file);
+        close(*fd);
+        return NULL;
+    }
+
+    /* Concurrent initializations write the same thing, so that's fine */
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != TABLE_MAGIC) {
+        hdr->version = TABLE_VERSION;
+        hdr->slots = TABLE_SLOTS;
+        hdr->slot_size = sizeof(struct table_slot);
+        __atomic_store_n(&hdr->magic, TABLE_MAGIC, __ATOMIC_RELEASE);
+    }
+    if (hdr->version != TABLE_VERSION || hdr->slots != TABLE_SLOTS
+            || hdr->slot_size != sizeof(struct table_slot)) {
+        if (rd) log_error(rd, "Invalid table %s", file);
+        munmap(hdr, size);
+        close(*fd);
+        return NULL;
+    }
+
+    return hdr;
+}
+
+static void
+table_unmap(struct table_header *hdr, int fd)
+{
+    munmap(hdr, (TABLE_SLOTS + 1) * sizeof(struct table_slot));
+    close(fd);
+}
+
+/* Find the slot of uid in the table, claiming a free one if claim is set.
+ * Slots are never freed, so a free slot ends the search.
+ */
+static struct table_slot *
+table_slot(struct table_header *hdr, uid_t uid, int claim)
+{
+    struct table_slot *slots = (struct table_slot *) (hdr + 1);
+    uint32_t key = (uint32_t) uid + 1;
+    uint32_t h = fnv1a(&key, sizeof(key)) % TABLE_SLOTS;
+    uint32_t i;
+
+    for (i = 0; i < TABLE_SLOTS; ++i) {
+        struct table_slot *slot = &slots[(h + i) % TABLE_SLOTS];
+        uint32_t k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+
+        if (k == 0) {
+            if (!claim)
+                return NULL;
+            if (__atomic_compare_exchange_n(&slot->key, &k, key, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return slot;
+            /* Someone else claimed it; k is now theirs */
+        }
+        if (k == key)
+            return slot;
+    }
+    return NULL;
+}
+
+/* The byte range of slot in the table, for locking */
+static void
+table_range(struct table_header *hdr, struct table_slot *slot, struct flock *range)
+{
+    memset(range, 0, sizeof(*range));
+    range->l_type = F_WRLCK;
+    range->l_whence = SEEK_SET;
+    range->l_start = (char *) slot - (char *) hdr;
+    range->l_len = sizeof(*slot);
+}
+
+/* Whether directory name (in parentfd) is ready for use by uid: a real
+ * directory (not a symlink), owned by uid, with the given mode */
+static int
+dir_ready(int parentfd, const char *name, uid_t uid, mode_t mode)
+{
+    struct stat st;
+
+    return fstatat(parentfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)
+        && st.st_uid == uid && (st.st_mode & 07777) == mode;
+}
+
+/* Whether runtime directory name (in the parent dir) and the extra dirs of
+ * session s are ready for use, as created by open session. One fstatat() per
+ * directory, so that joining sessions don't need to create or fix anything.
+ */
+static int
+runtime_dir_ready(const struct rundir_session *s, const char *name)
+{
+    const struct options *opts = &s->rd->opts;
+    const char *extra;
+    int i;
+
+    if (!dir_ready(s->parentfd, name, s->uid, opts->mode))
+        return 0;
+    for (i = 0, extra = s->extra; i < opts->nb_extra; ++i, extra += strlen(extra) + 1) {
+        if (!dir_ready(s->parentfd, extra + opts->dir_len + 1, s->uid, opts->extra[i].mode))
+            return 0;
+    }
+    return 1;
+}
+
+/* Lock-free counterpart of incrementing the counter: only possible while it
+ * is positive, i.e. nothing needs to be created. The runtime directory (name)
+ * and the extra ones must exist then, but we check for them first in case
+ * their creator is still in the process of creating them, or one was removed
+ * since (then the lock is taken, to recreate it).
+ * Returns 1 if the counter was incremented (and the table's identity recorded
+ * into sd), else 0 (take the lock).
+ */
+static int
+table_attach(const struct options *opts, struct rundir_session *sd, const char *name)
+{
+    const uid_t uid = sd->uid;
+    struct table_header *hdr;
+    struct table_slot *slot;
+    struct stat st;
+    int r = 0;
+    int fd;
+
+    hdr = table_map(opts, sd->parentfd, NULL, &fd, &st);
+    if (!hdr)
+        return 0;
+    sd->dev = st.st_dev;
+    sd->ino = st.st_ino;
+
+    slot = table_slot(hdr, uid, 0);
+    if (slot) {
+        int32_t c = __atomic_load_n(&slot->count, __ATOMIC_ACQUIRE);
+
+        while (c > 0 && runtime_dir_ready(sd, name)) {
+            if (__atomic_compare_exchange_n(&slot->count, &c, c + 1, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                r = 1;
+                break;
+            }
+        }
+    }
+
+    table_unmap(hdr, fd);
+    return r;
+}
+
+/* Lock-free counterpart of decrementing the counter: only possible when it
+ * doesn't reach zero, i.e. nothing needs to be removed, and the table is the
+ * one sd was counted in.
+ * Returns 1 if the counter was decremented, else 0 (take the lock).
+ */
+static int
+table_detach(const struct options *opts, int parentfd, const struct rundir_session *sd)
+{
+    struct table_header *hdr;
+    struct table_slot *slot;
+    struct stat st;
+    int r = 0;
+    int fd;
+
+    hdr = table_map(opts, parentfd, NULL, &fd, &st);
+    if (!hdr)
+        return 0;
+
+    slot = table_slot(hdr, sd->uid, 0);
+    if (slot && st.st_dev == sd->dev && st.st_ino == sd->ino) {
+        int32_t c = __atomic_load_n(&slot->count, __ATOMIC_ACQUIRE);
+
+        while (c > 1) {
+            if (__atomic_compare_exchange_n(&slot->count, &c, c - 1, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                r = 1;
+                break;
+            }
+        }
+    }
+
+    table_unmap(hdr, fd);
+    return r;
+}
+
+/* Open and lock the counter of uid: the (already constructed) counter file, or
+ * its slot in the table. Holding that lock is needed to create or remove the
+ * runtime directory. Opened relative to parentfd, unless AT_FDCWD.
+ */
+static int
+counter_lock(const struct rundir *rd, const struct options *opts, int parentfd, uid_t uid,
+             const char *counter, struct counter *c)
+{
+    char file[MAX_PATH_LEN];
+    struct flock range;
+    struct stat st;
+
+    c->table = NULL;
+    c->slot = NULL;
+
+    if (!opts->table) {
+        c->fd = open_and_lock(parentfd, counter, rd, opts);
+        if (c->fd < 0)
+            return -1;
+        if (fstat(c->fd, &st) < 0) {
+            log_error(rd, "Failed to stat %s: %m", counter);
+            close(c->fd);
+            return -1;
+        }
+        c->dev = st.st_dev;
+        c->ino = st.st_ino;
+        return 0;
+    }
+
+    c->table = table_map(opts, parentfd, rd, &c->fd, &st);
+    if (!c->table)
+        return -1;
+    c->dev = st.st_dev;
+    c->ino = st.st_ino;
+
+    c->slot = table_slot(c->table, uid, 1);
+    if (!c->slot) {
+        log_error(rd, "No free slot in %s", parent_path(opts, file, TABLE_NAME));
+        table_unmap(c->table, c->fd);
+        return -1;
+    }
+
+    table_range(c->table, c->slot, &range);
+    if (lock_fd(c->fd, &range, parent_path(opts, file, TABLE_NAME), rd, opts) < 0) {
+        table_unmap(c->table, c->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Release the counter; closing the table releases the slot lock as well */
+static void
+counter_unlock(struct counter *c)
+{
+    if (c->table)
+        table_unmap(c->table, c->fd);
+    else
+        close(c->fd); /* Also releases the lock */
+}
+
+/* Same as read_counter() */
+static int
+counter_read(struct counter *c)
+{
+    struct timespec ts;
+    int32_t count;
+
+    if (!c->table) {
+        phase_start(&ts);
+        count = read_counter(c->fd);
+        phase_end(PHASE_COUNTER, &ts);
+        return count;
+    }
+
+    count = __atomic_load_n(&c->slot->count, __ATOMIC_ACQUIRE);
+    return (count < 0) ? -2 : count;
+}
+
+/* Update the counter from old to count. With the table, the counter can be
+ * changed without the lock (while positive, see table_attach()), so this
+ * returns 1 (and nothing is written) when it isn't old anymore. Otherwise
+ * same as write_counter().
+ */
+static int
+counter_write(struct counter *c, int old, int count)
+{
+    int32_t expected = (old < 0) ? -1 : old;
+    struct timespec ts;
+    int r;
+
+    if (!c->table) {
+        phase_start(&ts);
+        r = write_counter(c->fd, count);
+        phase_end(PHASE_COUNTER, &ts);
+        return r;
+    }
+
+    if (!__atomic_compare_exchange_n(&c->slot->count, &expected, (count < 0) ? -1 : count,
+                                     0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return 1;
+    return 0;
+}
+
+/* Set the linger expiry of an unused (count 0) runtime directory */
+static int
+counter_set_expiry(struct counter *c, time_t expiry)
+{
+    struct timespec ts[2] = { { 0, UTIME_OMIT }, { expiry, 0 } };
+
+    if (!c->table)
+        /* The counter's mtime is the expiry */
+        return futimens(c->fd, ts);
+
+    __atomic_store_n(&c->slot->expires, (int64_t) expiry, __ATOMIC_RELEASE);
+    return 0;
+}
+
+#ifdef HAVE_URING
+/* An io_uring, set up with raw syscalls */
+struct uring {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_sqe *sqes;
+    void *ring;                    /* SQ and CQ rings, in one mapping */
+    size_t ring_size;
+    size_t sqes_size;
+};
+
+/* Set up ring for URING_BATCH entries. Returns 0 on success, -1 if io_uring
+ * isn't available (old kernel, or disabled with kernel.io_uring_disabled) */
+static int
+uring_init(struct uring *ring)
+{
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *ptr;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = (int) syscall(__NR_io_uring_setup, URING_BATCH, &p);
+    if (ring->fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        return -1;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->ring, ring->ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    ptr = ring->ring;
+    ring->sq_tail = (unsigned *) (ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *) (ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (ptr + p.cq_off.cqes);
+    return 0;
+}
+
+static void
+uring_free(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring, ring->ring_size);
+    close(ring->fd);
+}
+
+/* Unlink the n (at most URING_BATCH) names from dirfd through ring, and wait
+ * for all of them. res[i] is set to the result of names[i], 0 or -errno, or
+ * left at 1 if the ring didn't get to it. Submission goes on from where a short
+ * one stopped; once the kernel takes nothing while no completion can make room,
+ * or fails, what it didn't take is dropped from the SQ ring.
+ * Returns 0 if all were done, -1 if the ring failed (what's left at 1 is then
+ * for the caller to unlink itself). */
+static int
+uring_unlink(struct uring *ring, int dirfd, char (*names)[NAME_MAX + 1],
+             int *res, unsigned n)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned submitted = 0, done = 0;
+    unsigned head;
+    unsigned i;
+    long r;
+
+    for (i = 0; i < n; ++i) {
+        unsigned idx = (tail + i) & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_UNLINKAT;
+        sqe->fd = dirfd;
+        sqe->addr = (uintptr_t) names[i];
+        sqe->user_data = i;
+        ring->sq_array[idx] = idx;
+        res[i] = 1;
+    }
+    __atomic_store_n(ring->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+    while (done < n) {
+        if (submitted < n) {
+            r = syscall(__NR_io_uring_enter, ring->fd, n - submitted, 0, 0, NULL, 0);
+            if (r > 0) {
+                submitted += r;
+            } else if (r < 0 && errno == EINTR) {
+                continue;
+            } else if (submitted == done || (r < 0 && errno != EAGAIN && errno != EBUSY)) {
+                /* Nothing in flight whose completion would make room */
+                break;
+            }
+        }
+
+        /* Only waiting on what was submitted, which the kernel can't do
+         * after a short submission */
+        if (submitted > done) {
+            r = syscall(__NR_io_uring_enter, ring->fd, 0, submitted - done,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+            if (r < 0 && errno != EINTR)
+                break;
+        }
+
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+            res[cqe->user_data] = cqe->res;
+            ++head;
+            ++done;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (done == n)
+        return 0;
+
+    __atomic_store_n(ring->sq_tail, tail + submitted, __ATOMIC_RELEASE);
+    return -1;
+}
+#endif
+
+/* An entry as returned by getdents64 */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* Call fn for every entry of directory fd but . and .., listed with
+ * getdents64 (no DIR allocation, nor stat of entries where the filesystem
+ * gives their type). Entries may be removed by fn. This walks teardown, the
+ * skeleton copy, the pool and rundir_gc().
+ * Returns 0, or -1 on error.
+ */
+static int
+list_dir(int fd, void (*fn)(int fd, const char *name, unsigned char type, void *data),
+         void *data)
+{
+    char *buf = aligned_alloc(8, DENTS_BUF);
+    long n;
+    long off;
+
+    if (buf == NULL)
+        return -1;
+    for (;;) {
+        do { n = syscall(SYS_getdents64, fd, buf, DENTS_BUF); }
+        while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            break;
+
+        for (off = 0; off < n; ) {
+            const struct linux_dirent64 *d = (const struct linux_dirent64 *) (buf + off);
+            unsigned char type = d->d_type;
+            struct stat st;
+
+            off += d->d_reclen;
+            if (d->d_name[0] == '.' && (d->d_name[1] == '\0'
+                        || (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+                continue;
+            if (type == DT_UNKNOWN && fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                type = IFTODT(st.st_mode);
+            fn(fd, d->d_name, type, data);
+        }
+    }
+    free(buf);
+    return (int) n;
+}
+
+/* State of a removal, shared across the whole tree */
+struct rmrf_ctx {
+    const struct rundir *rd;
+    const char *top;               /* Path of the tree's root, for messages */
+    dev_t dev;                     /* Device of the tree's root */
+    unsigned long entries;         /* Entries removed so far */
+    int usage;                     /* Count the space they used, into bytes */
+    uint64_t bytes;
+#ifdef HAVE_URING
+    struct uring *ring;            /* To batch unlinks, if not NULL */
+#endif
+};
+
+static int rmrf_at(int dirfd, const char *name, int is_dir, struct rmrf_ctx *ctx);
+
+#ifdef HAVE_URING
+/* Names of non-directories in a directory, waiting to be unlinked */
+struct unlink_batch {
+    unsigned n;
+    int res[URING_BATCH];
+    char names[URING_BATCH][NAME_MAX + 1];
+};
+
+/* Unlink all names in batch from dirfd through the ring. Whatever the ring
+ * couldn't do (e.g. unsupported by the kernel, a name that turned out to be a
+ * directory, or one it never got to) goes through rmrf_at(). */
+static int
+flush_unlinks(int dirfd, struct unlink_batch *batch, struct rmrf_ctx *ctx)
+{
+    unsigned i;
+    int r = 0;
+
+    if (batch->n == 0)
+        return 0;
+
+    if (uring_unlink(ctx->ring, dirfd, batch->names, batch->res, batch->n) < 0) {
+        /* Don't try again, do it all synchronously from now on */
+        uring_free(ctx->ring);
+        ctx->ring = NULL;
+    }
+
+    for (i = 0; i < batch->n; ++i) {
+        if (batch->res[i] == 0) {
+            ++ctx->entries;
+        } else if (batch->res[i] != -ENOENT) {
+            if (rmrf_at(dirfd, batch->names[i], -1, ctx) < 0)
+                r = -1;
+        }
+    }
+    batch->n = 0;
+
+    return r;
+}
+#endif
+
+/* Entries of a directory being removed by rmrf_children() */
+struct rmrf_scan {
+    struct rmrf_ctx *ctx;
+#ifdef HAVE_URING
+    struct unlink_batch *batch;
+#endif
+    int r;
+};
+
+static void
+rmrf_entry(int fd, const char *name, unsigned char type, void *data)
+{
+    struct rmrf_scan *scan = data;
+    struct stat st;
+
+    /* Only files use space worth counting */
+    if (scan->ctx->usage && type != DT_DIR && fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+        scan->ctx->bytes += (uint64_t) st.st_blocks * 512;
+
+#ifdef HAVE_URING
+    /* Non-directories are unlinked in batches through the ring. Nothing is in
+     * flight while we recurse, batches are only ever submitted and completed
+     * as a whole. */
+    if (scan->batch && scan->ctx->ring && type != DT_DIR && type != DT_UNKNOWN) {
+        strcpy(scan->batch->names[scan->batch->n++], name);
+        if (scan->batch->n == URING_BATCH && flush_unlinks(fd, scan->batch, scan->ctx) < 0)
+            scan->r = -1;
+        return;
+    }
+#endif
+
+    /* d_type saves a stat() per entry; DT_UNKNOWN is sorted out by rmrf_at()
+     * itself */
+    if (rmrf_at(fd, name, type == DT_DIR ? 1 : (type == DT_UNKNOWN ? -1 : 0), scan->ctx) < 0)
+        scan->r = -1;
+}
+
+/* Remove all entries of the directory open as fd, which is closed */
+static int
+rmrf_children(int fd, struct rmrf_ctx *ctx)
+{
+    struct rmrf_scan scan = { .ctx = ctx, .r = 0 };
+
+#ifdef HAVE_URING
+    if (ctx->ring)
+        scan.batch = malloc(sizeof(*scan.batch));
+    if (scan.batch)
+        scan.batch->n = 0;
+#endif
+
+    if (list_dir(fd, rmrf_entry, &scan) < 0) {
+        if (ctx->rd) log_error(ctx->rd, "Failed to read directory in %s: %m", ctx->top);
+        scan.r = -1;
+    }
+#ifdef HAVE_URING
+    if (scan.batch) {
+        if (flush_unlinks(fd, scan.batch, ctx) < 0)
+            scan.r = -1;
+        free(scan.batch);
+    }
+#endif
+    close(fd);
+
+    return scan.r;
+}
+
+/* Remove name from directory dirfd, recursively if it's a directory.
+ * is_dir tells whether name is known to be a directory (1), not one (0), or
+ * unknown (-1).
+ * Everything is done relative to directory fds, so no path is ever resolved
+ * again, and nothing can be followed out of the tree: directories are opened
+ * with O_NOFOLLOW (a symlink swapped in is just unlinked), and we won't
+ * descend into a different filesystem.
+ */
+static int
+rmrf_at (int dirfd, const char *name, int is_dir, struct rmrf_ctx *ctx)
+{
+    struct stat st;
+    int fd;
+
+    if (is_dir != 1) {
+        if (unlinkat(dirfd, name, 0) == 0) {
+            ++ctx->entries;
+            return 0;
+        } else if (errno == ENOENT) {
+            return 0;
+        } else if (errno != EISDIR && errno != EPERM) {
+            if (ctx->rd) log_error(ctx->rd, "Failed to unlink %s in %s: %m", name, ctx->top);
+            return -1;
+        }
+    }
+
+    fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        if ((errno == ENOTDIR || errno == ELOOP) && unlinkat(dirfd, name, 0) == 0) {
+            ++ctx->entries;
+            return 0;
+        }
+        if (ctx->rd) log_error(ctx->rd, "Failed to open directory %s in %s: %m", name, ctx->top);
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_dev != ctx->dev) {
+        if (ctx->rd) log_error(ctx->rd, "Not removing %s in %s: different filesystem", name, ctx->top);
+        close(fd);
+        return -1;
+    }
+
+    /* Errors are reported, and will make the rmdir fail */
+    rmrf_children(fd, ctx);
+
+    if (unlinkat(dirfd, name, AT_REMOVEDIR) < 0) {
+        if (ctx->rd) log_error(ctx->rd, "Failed to remove directory %s in %s: %m", name, ctx->top);
+        return -1;
+    }
+    ++ctx->entries;
+
+    return 0;
+}
+
+/* Safely remove directory name, found in directory dirfd (whose path is top),
+ * and its contents. With teardown=uring, non-directories are unlinked in
+ * batches through io_uring when available. */
+static int
+rmrf (const struct options *opts, int dirfd, const char *top, const char *name,
+      const struct rundir *rd)
+{
+    struct rmrf_ctx ctx = { .rd = rd, .top = top, .usage = opts->usage > 0 };
+    struct stat st;
+    int r;
+#ifdef HAVE_URING
+    struct uring ring;
+#endif
+
+    /* The tree's root is the reference for not crossing filesystems */
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        if (errno == ENOENT)
+            return 0;
+        if (rd) log_error(rd, "Failed to stat %s in %s: %m", name, top);
+        return -1;
+    }
+    ctx.dev = st.st_dev;
+
+#ifdef HAVE_URING
+    /* Falls back to unlinking synchronously if io_uring isn't available */
+    if (opts->uring && S_ISDIR(st.st_mode) && uring_init(&ring) == 0)
+        ctx.ring = &ring;
+#endif
+
+    PROBE2(rmrf_start, top, name);
+    r = rmrf_at(dirfd, name, S_ISDIR(st.st_mode), &ctx);
+    PROBE3(rmrf_end, name, ctx.entries, r);
+#ifdef HAVE_URING
+    if (ctx.ring)
+        uring_free(ctx.ring);
+#endif
+    timing.entries += ctx.entries;
+    timing.bytes += ctx.bytes;
+    return r;
+}
+
+/* State of a skeleton copy, for a directory of the tree */
+struct skel_ctx {
+    const struct rundir *rd;
+    const char *top;               /* Path of the new runtime dir, for messages */
+    int dstfd;                     /* Directory being populated */
+    uid_t uid;
+    gid_t gid;
+    int r;
+};
+
+/* Hand name (open as fd) over to the user, with the mode of its original */
+static void
+skel_own(struct skel_ctx *ctx, int fd, const char *name, mode_t mode)
+{
+    /* Set-id bits aren't copied */
+    if (fchown(fd, ctx->uid, ctx->gid) < 0 || fchmod(fd, mode & 01777) < 0) {
+        log_error(ctx->rd, "Failed to set up %s in %s: %m", name, ctx->top);
+        ctx->r = -1;
+    }
+}
+
+/* Copy entry name of the skeleton directory fd into ctx->dstfd. Directories,
+ * regular files and symlinks are copied, anything else skipped; existing
+ * entries are kept as they are. All is done relative to directory fds, and
+ * created with O_EXCL/O_NOFOLLOW, so nothing is ever followed.
+ */
+static void
+skel_entry(int fd, const char *name, unsigned char type, void *data)
+{
+    struct skel_ctx *ctx = data;
+    struct stat st;
+    int src = -1;
+    int dst = -1;
+
+    if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        goto error;
+
+    if (type == DT_DIR) {
+        struct skel_ctx sub = *ctx;
+
+        if (mkdirat(ctx->dstfd, name, S_IRWXU) < 0 && errno != EEXIST)
+            goto error;
+        src = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        dst = openat(ctx->dstfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (src < 0 || dst < 0)
+            goto error;
+        sub.dstfd = dst;
+        if (list_dir(src, skel_entry, &sub) < 0)
+            goto error;
+        if (sub.r < 0)
+            ctx->r = -1;
+        skel_own(ctx, dst, name, st.st_mode);
+    } else if (type == DT_REG) {
+        off_t left = st.st_size;
+
+        src = openat(fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (src < 0)
+            goto error;
+        dst = openat(ctx->dstfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                     S_IRUSR | S_IWUSR);
+        if (dst < 0) {
+            if (errno == EEXIST)
+                goto done;
+            goto error;
+        }
+        while (left > 0) {
+            ssize_t n = sendfile(dst, src, NULL, left);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                goto error;
+            left -= n;
+        }
+        skel_own(ctx, dst, name, st.st_mode);
+    } else if (type == DT_LNK) {
+        char target[PATH_MAX];
+        ssize_t n = readlinkat(fd, name, target, sizeof(target) - 1);
+
+        if (n < 0)
+            goto error;
+        target[n] = '\0';
+        if (symlinkat(target, ctx->dstfd, name) < 0) {
+            if (errno == EEXIST)
+                goto done;
+            goto error;
+        }
+        if (fchownat(ctx->dstfd, name, ctx->uid, ctx->gid, AT_SYMLINK_NOFOLLOW) < 0)
+            goto error;
+    }
+    goto done;
+
+error:
+    log_error(ctx->rd, "Failed to copy skeleton entry %s into %s: %m", name, ctx->top);
+    ctx->r = -1;
+done:
+    if (src >= 0)
+        close(src);
+    if (dst >= 0)
+        close(dst);
+}
+
+/* Populate the new runtime directory dstfd (path) with a copy of skel=,
+ * handed over to uid:gid. It's done before the directory itself is, so the
+ * user can't get in the way. Failures are logged, but only leave the copy
+ * incomplete.
+ */
+static void
+copy_skel(const struct options *opts, const struct rundir *rd, int dstfd,
+          const char *path, uid_t uid, gid_t gid)
+{
+    struct skel_ctx ctx = { .rd = rd, .top = path, .dstfd = dstfd, .uid = uid, .gid = gid };
+    int fd;
+
+    fd = open(opts->skel, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error(rd, "Failed to open skeleton directory %s: %m", opts->skel);
+        return;
+    }
+    if (list_dir(fd, skel_entry, &ctx) < 0)
+        log_error(rd, "Failed to read skeleton directory %s: %m", opts->skel);
+    close(fd);
+}
+
+/* Open name (TRASH_NAME or POOL_NAME) within the parent dir (open as parentfd),
+ * creating it if needed. It must be a root-owned directory, since we'll be
+ * removing what's in it, or handing it out.
+ */
+static int
+open_root_dir(const struct options *opts, int parentfd, const char *name,
+              const struct rundir *rd)
+{
+    struct stat st;
+    int fd;
+
+    if (mkdirat(parentfd, name, S_IRWXU) < 0 && errno != EEXIST) {
+        if (rd) log_error(rd, "Failed to create directory %s/%s: %m", opts->dir, name);
+        return -1;
+    }
+
+    fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        if (rd) log_error(rd, "Failed to open directory %s/%s: %m", opts->dir, name);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_uid != 0) {
+        if (rd) log_error(rd, "%s/%s is not owned by root", opts->dir, name);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Move directory name (in the parent dir) to a tombstone in TRASH_NAME, for the
+ * reaper to remove later. It gets a unique name, so a runtime directory can be
+ * recreated right away even if the reaper hasn't gone through the previous one.
+ * Returns 1 if moved, 0 if there was nothing to move, -1 on error.
+ */
+static int
+move_to_trash(const struct options *opts, int parentfd, const char *name, const struct rundir *rd)
+{
+    char tomb[MAX_NAME_LEN + 32];
+    struct timespec ts;
+    int trashfd;
+    int r;
+
+    trashfd = open_root_dir(opts, parentfd, TRASH_NAME, rd);
+    if (trashfd < 0)
+        return -1;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    snprintf(tomb, sizeof(tomb), "%.*s.%lx%08lx.%x", MAX_NAME_LEN, name,
+             (unsigned long) ts.tv_sec, (unsigned long) ts.tv_nsec, (unsigned) getpid());
+
+    if (renameat(parentfd, name, trashfd, tomb) == 0) {
+        r = 1;
+    } else if (errno == ENOENT) {
+        r = 0;
+    } else {
+        log_error(rd, "Failed to move %s/%s to %s/%s: %m", opts->dir, name, TRASH_NAME, tomb);
+        r = -1;
+    }
+
+    close(trashfd);
+    return r;
+}
+
+/* A directory being removed by the reaper's threads */
+struct rmrf_task {
+    struct rmrf_task *parent;      /* NULL for the root, which is kept */
+    struct rmrf_task *next;        /* In the queue */
+    int fd;                        /* The directory, so children can be removed */
+    unsigned pending;              /* Its own scan, plus children not removed yet */
+    char name[];                   /* In parent */
+};
+
+/* Threads pull directories from a shared queue; each scan unlinks what it
+ * finds, and queues subdirectories. A directory is removed by whoever finishes
+ * its last child (or its scan), which then goes on with the parent. */
+struct rmrf_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct rmrf_task *queue;       /* LIFO, for locality */
+    unsigned queued;
+    int done;                      /* The root is done */
+    const struct rundir *rd;       /* For messages */
+    const char *top;
+    dev_t dev;
+    unsigned long removed;         /* Children of the root removed */
+    unsigned long failed;          /* Those that couldn't be */
+};
+
+/* Entries of a directory scanned by pool_worker(), with the thread's own ctx */
+struct task_scan {
+    struct rmrf_pool *pool;
+    struct rmrf_task *task;
+    struct rmrf_ctx *ctx;
+};
+
+static void
+pool_push(struct rmrf_pool *pool, struct rmrf_task *task)
+{
+    pthread_mutex_lock(&pool->lock);
+    task->next = pool->queue;
+    pool->queue = task;
+    ++pool->queued;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* An entry of task's directory couldn't be removed. Only children of the root
+ * are counted: below it, the failure shows as that of their ancestor. */
+static void
+task_failed(struct rmrf_pool *pool, const struct rmrf_task *task)
+{
+    if (!task->parent)
+        __atomic_add_fetch(&pool->failed, 1, __ATOMIC_RELAXED);
+}
+
+/* One step done for task (scan or child): the last one removes the directory,
+ * which is then a step done for its parent, and so on. */
+static void
+task_done(struct rmrf_pool *pool, struct rmrf_task *task)
+{
+    while (__atomic_sub_fetch(&task->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct rmrf_task *parent = task->parent;
+
+        if (!parent) {
+            close(task->fd);
+            free(task);
+            pthread_mutex_lock(&pool->lock);
+            pool->done = 1;
+            pthread_cond_broadcast(&pool->cond);
+            pthread_mutex_unlock(&pool->lock);
+            return;
+        }
+
+        close(task->fd);
+        if (unlinkat(parent->fd, task->name, AT_REMOVEDIR) == 0) {
+            if (!parent->parent)
+                __atomic_add_fetch(&pool->removed, 1, __ATOMIC_RELAXED);
+        } else {
+            log_error(pool->rd, "Failed to remove directory %s in %s: %m", task->name, pool->top);
+            task_failed(pool, parent);
+        }
+        free(task);
+        task = parent;
+    }
+}
+
+/* Remove name from the directory fd being scanned (see struct task_scan) */
+static void
+task_entry(int fd, const char *name, unsigned char type, void *data)
+{
+    struct task_scan *scan = data;
+    struct rmrf_pool *pool = scan->pool;
+    struct rmrf_task *task = scan->task;
+    struct rmrf_task *child;
+    struct stat st;
+    size_t l;
+
+    if (type != DT_DIR && type != DT_UNKNOWN) {
+        if (unlinkat(task->fd, name, 0) == 0) {
+            if (!task->parent)
+                __atomic_add_fetch(&pool->removed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        if (errno == ENOENT)
+            return;
+        if (errno != EISDIR && errno != EPERM) {
+            log_error(pool->rd, "Failed to unlink %s in %s: %m", name, pool->top);
+            task_failed(pool, task);
+            return;
+        }
+    }
+
+    /* Too much queued already: go depth-first, that bounds the open fds */
+    if (__atomic_load_n(&pool->queued, __ATOMIC_RELAXED) >= REAPER_QUEUE) {
+        if (rmrf_at(task->fd, name, -1, scan->ctx) < 0)
+            task_failed(pool, task);
+        else if (!task->parent)
+            __atomic_add_fetch(&pool->removed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    fd = openat(task->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return;
+        if ((errno == ENOTDIR || errno == ELOOP) && unlinkat(task->fd, name, 0) == 0) {
+            if (!task->parent)
+                __atomic_add_fetch(&pool->removed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        log_error(pool->rd, "Failed to open directory %s in %s: %m", name, pool->top);
+        task_failed(pool, task);
+        return;
+    }
+    if (fstat(fd, &st) < 0 || st.st_dev != pool->dev) {
+        log_error(pool->rd, "Not removing %s in %s: different filesystem", name, pool->top);
+        task_failed(pool, task);
+        close(fd);
+        return;
+    }
+    l = strlen(name);
+    child = malloc(sizeof(*child) + l + 1);
+    if (child == NULL) {
+        log_error(pool->rd, "Failed to allocate memory to remove %s in %s", name, pool->top);
+        task_failed(pool, task);
+        close(fd);
+        return;
+    }
+    child->parent = task;
+    child->fd = fd;
+    child->pending = 1;
+    memcpy(child->name, name, l + 1);
+    __atomic_add_fetch(&task->pending, 1, __ATOMIC_ACQ_REL);
+    pool_push(pool, child);
+}
+
+static void *
+pool_worker(void *arg)
+{
+    struct rmrf_pool *pool = arg;
+    struct rmrf_ctx ctx = { .rd = pool->rd, .top = pool->top, .dev = pool->dev };
+
+    for (;;) {
+        struct task_scan scan = { pool, NULL, &ctx };
+        struct rmrf_task *task;
+
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->queue && !pool->done)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        task = pool->queue;
+        if (task) {
+            pool->queue = task->next;
+            --pool->queued;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (!task)
+            break;
+
+        /* The root's fd shares its offset, a previous pass left it at the end */
+        scan.task = task;
+        if (lseek(task->fd, 0, SEEK_SET) < 0 || list_dir(task->fd, task_entry, &scan) < 0) {
+            /* Below the root, its removal fails and is counted then */
+            if (!task->parent) {
+                log_error(pool->rd, "Failed to list directory %s: %m", pool->top);
+                __atomic_add_fetch(&pool->failed, 1, __ATOMIC_RELAXED);
+            } else {
+                log_error(pool->rd, "Failed to list directory %s in %s: %m", task->name,
+                          pool->top);
+            }
+        }
+        task_done(pool, task);
+    }
+
+    return NULL;
+}
+
+/* Remove everything in directory fd (whose path is top) with threads threads,
+ * the calling one included. Returns the number of entries of fd removed, and
+ * into failed the number of those that couldn't be. */
+static unsigned long
+rmrf_parallel(int fd, const char *top, long threads, const struct rundir *rd,
+              unsigned long *failed)
+{
+    struct rmrf_pool pool = { .rd = rd, .top = top };
+    pthread_t tids[MAX_REAPER_THREADS];
+    struct rmrf_task *root;
+    struct stat st;
+    long n = 0;
+
+    *failed = 1;
+    if (fstat(fd, &st) < 0 || !(root = malloc(sizeof(*root) + 1))) {
+        log_error(rd, "Failed to remove the content of %s: %m", top);
+        return 0;
+    }
+    root->fd = dup(fd);
+    if (root->fd < 0) {
+        log_error(rd, "Failed to remove the content of %s: %m", top);
+        free(root);
+        return 0;
+    }
+    root->parent = NULL;
+    root->pending = 1;
+    root->name[0] = '\0';
+    pool.dev = st.st_dev;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool_push(&pool, root);
+
+    while (n < threads - 1 && pthread_create(&tids[n], NULL, pool_worker, &pool) == 0)
+        ++n;
+    pool_worker(&pool);
+    while (n > 0)
+        pthread_join(tids[--n], NULL);
+
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.lock);
+    *failed = pool.failed;
+    return pool.removed;
+}
+
+/* Tombstones removed one at a time by reap_trash() */
+struct trash_scan {
+    const struct options *opts;
+    const struct rundir *rd;
+    const char *top;
+    unsigned long removed;
+    unsigned long failed;
+};
+
+static void
+trash_entry(int fd, const char *name, unsigned char type, void *data)
+{
+    struct trash_scan *scan = data;
+
+    (void)type;
+    if (name[0] == '.')
+        return;
+    if (rmrf(scan->opts, fd, scan->top, name, scan->rd) == 0)
+        ++scan->removed;
+    else
+        ++scan->failed;
+}
+
+/* Remove all tombstones. Only one reaper works at a time, holding a lock on
+ * TRASH_NAME; others just leave. With reaper_threads=, they're removed by that
+ * many threads at once. Returns the number of tombstones that couldn't be
+ * removed.
+ */
+static unsigned long
+reap_trash(const struct options *opts, const struct rundir *rd)
+{
+    struct trash_scan scan = { .opts = opts, .rd = rd };
+    char top[MAX_PATH_LEN];
+    unsigned long failed = 0;
+    struct stat st;
+    int parentfd;
+    int fd;
+
+    parent_path(opts, top, TRASH_NAME);
+    scan.top = top;
+    parentfd = open(opts->dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (parentfd < 0)
+        return 0;
+    fd = open_root_dir(opts, parentfd, TRASH_NAME, rd);
+    close(parentfd);
+    if (fd < 0)
+        return 0;
+
+    /* Tombstones are directories, so they show in the link count. Check again
+     * after unlocking, for any that came in between our last look and then. */
+    do {
+        if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+            break;
+
+        /* Again as long as something was removed, tombstones that can't be
+         * removed are left for later */
+        if (opts->reaper_threads > 1) {
+            while (rmrf_parallel(fd, top, opts->reaper_threads, rd, &failed) > 0)
+                ;
+        } else {
+            do {
+                scan.removed = scan.failed = 0;
+                if (lseek(fd, 0, SEEK_SET) < 0 || list_dir(fd, trash_entry, &scan) < 0) {
+                    log_error(rd, "Failed to list directory %s: %m", top);
+                    ++scan.failed;
+                    break;
+                }
+            } while (scan.removed > 0);
+            failed = scan.failed;
+        }
+
+        flock(fd, LOCK_UN);
+    } while (failed == 0 && fstat(fd, &st) == 0 && st.st_nlink > 2);
+
+    close(fd);
+    return failed;
+}
+
+/* Fork a detached process to reap the trash, so the caller doesn't have to wait
+ * for the removal, and refill the pool. Failures only mean tombstones are left
+ * for the next reaper (or the pool runs low). The caller may have other threads,
+ * whose locks could be held in the child at fork, so the reaper is executed
+ * afresh (reaper=, i.e. rundir-gc -r), the child only doing async-signal-safe
+ * calls until then. It reports a failed exec through a pipe, closed on exec.
+ */
+static void
+spawn_reaper(const struct rundir *rd)
+{
+    static char *const envp[] = { NULL };
+    char *const *argv = rd->reaper_argv;
+    int pipefd[2];
+    int status = 0;
+    int e = 0;
+    pid_t pid;
+    ssize_t l;
+    int r;
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        log_error(rd, "Failed to fork reaper: %m");
+        return;
+    }
+    pid = fork();
+    if (pid < 0) {
+        log_error(rd, "Failed to fork reaper: %m");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return;
+    } else if (pid == 0) {
+        sigset_t set;
+        int fd;
+
+        /* Double fork, so the reaper is neither our child nor in our session */
+        if (setsid() < 0)
+            _exit(1);
+        pid = fork();
+        if (pid != 0)
+            _exit(pid < 0);
+
+        sigemptyset(&set);
+        sigprocmask(SIG_SETMASK, &set, NULL);
+        fd = open("/dev/null", O_RDWR);
+        if (fd >= 0) {
+            dup2(fd, STDIN_FILENO);
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        /* All but the pipe, which goes on exec */
+        if (pipefd[1] > STDERR_FILENO + 1)
+            close_range(STDERR_FILENO + 1, pipefd[1] - 1, 0);
+        close_range(pipefd[1] + 1, ~0U, 0);
+
+        execve(argv[0], argv, envp);
+        e = errno;
+        while (write(pipefd[1], &e, sizeof(e)) < 0 && errno == EINTR)
+            ;
+        _exit(127);
+    }
+
+    close(pipefd[1]);
+    do { r = waitpid(pid, &status, 0); }
+    while (r < 0 && errno == EINTR);
+    if (r == pid && WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        log_error(rd, "Failed to fork reaper");
+    } else {
+        /* Until the reaper's exec, or its failure */
+        do { l = read(pipefd[0], &e, sizeof(e)); }
+        while (l < 0 && errno == EINTR);
+        if (l == sizeof(e)) {
+            errno = e;
+            log_error(rd, "Failed to run reaper %s: %m", argv[0]);
+        }
+    }
+    close(pipefd[0]);
+}
+
+/* Whether there are tombstones waiting for a reaper */
+static int
+trash_pending(const struct options *opts)
+{
+    char file[MAX_PATH_LEN];
+    struct stat st;
+
+    return stat(parent_path(opts, file, TRASH_NAME), &st) == 0 && S_ISDIR(st.st_mode)
+        && st.st_nlink > 2;
+}
+
+/* Mount a tmpfs owned by uid:gid, of the given mode, on path, creating the
+ * directory if needed. The new mount API is used when available, else
+ * mount(2). If a tmpfs is already mounted there (e.g. it lingered), it is left
+ * as is.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+mount_tmpfs(const struct options *opts, const struct rundir *rd, const char *path,
+            mode_t mode, uid_t uid, gid_t gid)
+{
+    char data[128 + 2 * MAX_TMPFS_VALUE];
+    struct stat parent, st;
+    int l;
+
+    if (mkdir(path, S_IRWXU) < 0 && errno != EEXIST) {
+        log_error(rd, "Failed to create directory %s: %m", path);
+        return -1;
+    }
+    if (stat(opts->dir, &parent) < 0 || lstat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        log_error(rd, "Failed to stat directory %s: %m", path);
+        return -1;
+    }
+    if (st.st_dev != parent.st_dev) {
+        log_debug(rd, "Reusing tmpfs mounted on %s", path);
+        return 0;
+    }
+
+#ifdef FSOPEN_CLOEXEC
+    int fsfd = fsopen("tmpfs", FSOPEN_CLOEXEC);
+    if (fsfd >= 0) {
+        int mntfd = -1;
+
+        l = (fsconfig(fsfd, FSCONFIG_SET_STRING, "source", "tmpfs", 0) < 0) ? -1 : 0;
+        snprintf(data, sizeof(data), "%o", (unsigned) mode);
+        if (l == 0 && fsconfig(fsfd, FSCONFIG_SET_STRING, "mode", data, 0) < 0) l = -1;
+        snprintf(data, sizeof(data), "%u", (unsigned) uid);
+        if (l == 0 && fsconfig(fsfd, FSCONFIG_SET_STRING, "uid", data, 0) < 0) l = -1;
+        snprintf(data, sizeof(data), "%u", (unsigned) gid);
+        if (l == 0 && fsconfig(fsfd, FSCONFIG_SET_STRING, "gid", data, 0) < 0) l = -1;
+        if (l == 0 && opts->tmpfs_size[0] != '\0'
+                && fsconfig(fsfd, FSCONFIG_SET_STRING, "size", opts->tmpfs_size, 0) < 0) l = -1;
+        if (l == 0 && opts->tmpfs_nr_inodes[0] != '\0'
+                && fsconfig(fsfd, FSCONFIG_SET_STRING, "nr_inodes", opts->tmpfs_nr_inodes, 0) < 0) l = -1;
+        if (l == 0 && fsconfig(fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) < 0) l = -1;
+        if (l == 0)
+            mntfd = fsmount(fsfd, FSMOUNT_CLOEXEC, MOUNT_ATTR_NOSUID | MOUNT_ATTR_NODEV);
+        if (mntfd >= 0) {
+            l = move_mount(mntfd, "", AT_FDCWD, path, MOVE_MOUNT_F_EMPTY_PATH);
+            close(mntfd);
+        } else {
+            l = -1;
+        }
+        close(fsfd);
+
+        if (l < 0) {
+            log_error(rd, "Failed to mount tmpfs on %s: %m", path);
+            return -1;
+        }
+        return 0;
+    } else if (errno != ENOSYS) {
+        log_error(rd, "Failed to open tmpfs: %m");
+        return -1;
+    }
+#endif
+
+    l = snprintf(data, sizeof(data), "mode=%o,uid=%u,gid=%u",
+                 (unsigned) mode, (unsigned) uid, (unsigned) gid);
+    if (opts->tmpfs_size[0] != '\0')
+        l += snprintf(data + l, sizeof(data) - l, ",size=%s", opts->tmpfs_size);
+    if (opts->tmpfs_nr_inodes[0] != '\0')
+        snprintf(data + l, sizeof(data) - l, ",nr_inodes=%s", opts->tmpfs_nr_inodes);
+    if (mount("tmpfs", path, "tmpfs", MS_NOSUID | MS_NODEV, data) < 0) {
+        log_error(rd, "Failed to mount tmpfs on %s: %m", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Lazily unmount the tmpfs on runtime directory name (in the parent dir), then
+ * remove the (now empty) mount point. All of its content is freed at once by
+ * the kernel, whenever the last reference to it goes.
+ * Returns 1 on success, 0 if nothing's mounted there, -1 on error.
+ */
+static int
+unmount_tmpfs(const struct options *opts, int parentfd, const char *name,
+              const struct rundir *rd)
+{
+    char path[MAX_PATH_LEN];
+    struct statfs sf;
+    int usage;
+
+    /* What it holds is known without going through it */
+    usage = opts->usage > 0 && statfs(parent_path(opts, path, name), &sf) == 0;
+    if (umount2(parent_path(opts, path, name), MNT_DETACH | UMOUNT_NOFOLLOW) < 0) {
+        if (errno == EINVAL || errno == ENOENT)
+            return 0;
+        log_error(rd, "Failed to unmount %s: %m", path);
+        return -1;
+    }
+    if (usage) {
+        timing.entries += sf.f_files - sf.f_ffree;
+        timing.bytes += (uint64_t) (sf.f_blocks - sf.f_bfree) * sf.f_bsize;
+    }
+    if (unlinkat(parentfd, name, AT_REMOVEDIR) < 0 && errno != ENOENT) {
+        log_error(rd, "Failed to remove directory %s: %m", path);
+        return -1;
+    }
+    return 1;
+}
+
+/* Remove directory name from the parent dir (parentfd, or opened by path if
+ * AT_FDCWD), either right away or, in deferred mode, by moving it to
+ * the trash; reap is then set to 1, meaning a reaper should be spawned once
+ * the counter lock is released.
+ * In tmpfs mode, it is unmounted instead, which needs neither.
+ */
+static int
+remove_dir(const struct options *opts, int parentfd, const char *name,
+           const struct rundir *rd, int *reap)
+{
+    int r;
+
+    if (opts->tmpfs) {
+        r = unmount_tmpfs(opts, parentfd, name, rd);
+        /* Not mounted (e.g. created before tmpfs was enabled), remove it */
+        if (r != 0)
+            return (r > 0) ? 0 : -1;
+    }
+
+    /* If the move fails, remove it ourselves */
+    if (opts->defer_cleanup && (r = move_to_trash(opts, parentfd, name, rd)) >= 0) {
+        if (r > 0) *reap = 1;
+        return 0;
+    }
+
+    return rmrf(opts, parentfd, opts->dir, name, rd);
+}
+
+/* Remove the runtime directory name and the user's extra dirs (see
+ * remove_dir()), all covered by the same counter.
+ * Returns 0 on success, -1 if any couldn't be removed.
+ */
+static int
+do_remove_runtime_dir(const struct options *opts, int parentfd, const char *name,
+                      const struct rundir *rd, int *reap)
+{
+    char extra[MAX_NAME_LEN + 1];
+    unsigned long entries = timing.entries;
+    uint64_t bytes = timing.bytes;
+    struct timespec ts;
+    int r;
+    int i;
+
+    if (opts->usage > 0)
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+    r = remove_dir(opts, parentfd, name, rd, reap);
+    for (i = 0; i < opts->nb_extra; ++i)
+        if (remove_dir(opts, parentfd, extra_name(&opts->extra[i], name, extra), rd, reap) < 0)
+            r = -1;
+
+    /* Only what was gone through here, not moved to the trash */
+    if (opts->usage > 0 && timing.entries > entries) {
+        long long uid = parse_uid(name);
+
+        entries = timing.entries - entries;
+        bytes = timing.bytes - bytes;
+        PROBE3(teardown_usage, (int) uid, entries, bytes);
+        if (uid >= 0)
+            usage_add(opts, (uid_t) uid, entries, bytes, elapsed_us(&ts));
+    }
+    return r;
+}
+
+/* Same as do_remove_runtime_dir(), timed as PHASE_TEARDOWN */
+static int
+remove_runtime_dir(const struct options *opts, int parentfd, const char *name,
+                   const struct rundir *rd, int *reap)
+{
+    struct timespec ts;
+    int fd = parentfd;
+    int r;
+
+    phase_start(&ts);
+    if (fd == AT_FDCWD && (fd = open(opts->dir, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        log_error(rd, "Failed to open directory %s: %m", opts->dir);
+        r = -1;
+    } else {
+        r = do_remove_runtime_dir(opts, fd, name, rd, reap);
+        if (fd != parentfd)
+            close(fd);
+    }
+    phase_end(PHASE_TEARDOWN, &ts);
+    return r;
+}
+
+/* Set the mtime of the linger marker to expiry; unless it's already due
+ * earlier (or now), when merge is set.
+ * The marker's mtime is when the next linger expiry is due, so that open
+ * session only has to stat() it to know whether a sweep is needed.
+ * Returns the previous mtime, or -1 on error.
+ */
+static time_t
+update_linger_marker(const struct options *opts, time_t expiry, int merge)
+{
+    struct timespec ts[2] = { { 0, UTIME_OMIT }, { expiry, 0 } };
+    char file[MAX_PATH_LEN];
+    struct stat st;
+    int fd;
+
+    parent_path(opts, file, LINGER_NAME);
+    do { fd = open(file, O_RDWR | O_NOFOLLOW | O_CLOEXEC); }
+    while (fd < 0 && errno == EINTR);
+    if (fd < 0 && errno == ENOENT) {
+        /* A new marker's mtime is now, but nothing is due yet */
+        merge = 0;
+        do { fd = open(file, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+                       S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH); }
+        while (fd < 0 && errno == EINTR);
+    }
+    if (fd < 0)
+        return -1;
+
+    if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (!merge || st.st_mtime > expiry)
+        futimens(fd, ts);
+
+    close(fd); /* Also releases the lock */
+    return st.st_mtime;
+}
+
+/* sweep_lingering() for the counter table; returns the next expiry */
+static time_t
+sweep_table(const struct options *opts, uid_t skip_uid, time_t now, int *reap,
+            const struct rundir *rd)
+{
+    struct table_header *hdr;
+    struct table_slot *slots;
+    time_t next = LINGER_NEVER;
+    struct stat st;
+    uint32_t i;
+    int fd;
+
+    hdr = table_map(opts, AT_FDCWD, rd, &fd, &st);
+    if (!hdr)
+        return now;
+    slots = (struct table_slot *) (hdr + 1);
+
+    for (i = 0; i < TABLE_SLOTS; ++i) {
+        struct table_slot *slot = &slots[i];
+        uint32_t key = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        char name[MAX_UID_LENGTH + 1];
+        struct flock range;
+        int64_t expires;
+
+        if (key == 0 || key - 1 == (uint32_t) skip_uid
+                || __atomic_load_n(&slot->count, __ATOMIC_ACQUIRE) != 0
+                || __atomic_load_n(&slot->expires, __ATOMIC_ACQUIRE) == 0)
+            continue;
+
+        /* A busy slot is being used, so isn't lingering anymore */
+        table_range(hdr, slot, &range);
+        if (fcntl(fd, F_OFD_SETLK, &range) < 0)
+            continue;
+
+        expires = __atomic_load_n(&slot->expires, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->count, __ATOMIC_ACQUIRE) != 0 || expires == 0) {
+            /* Nothing to do */
+        } else if (expires > now) {
+            if (expires < next)
+                next = expires;
+        } else {
+            print_int(name, key - 1, intlen(key - 1));
+            name[intlen(key - 1)] = '\0';
+            if (remove_runtime_dir(opts, AT_FDCWD, name, rd, reap) < 0) {
+                log_error(rd, "Failed to remove lingering directory %s/%s",
+                          opts->dir, name);
+                __atomic_store_n(&slot->count, -1, __ATOMIC_RELEASE);
+            }
+            __atomic_store_n(&slot->expires, 0, __ATOMIC_RELEASE);
+        }
+
+        range.l_type = F_UNLCK;
+        fcntl(fd, F_OFD_SETLK, &range);
+    }
+
+    table_unmap(hdr, fd);
+    return next;
+}
+
+/* Remove lingering runtime directories whose expiry has passed, save for the
+ * one of skip_uid (i.e. the user opening a session, who's about to reuse it).
+ * A lingering directory is one whose counter is 0, the counter's mtime then
+ * being the expiry.
+ */
+static void
+sweep_lingering(const struct options *opts, uid_t skip_uid, const struct rundir *rd)
+{
+    time_t now = time(NULL);
+    time_t next = LINGER_NEVER;
+    char file[MAX_PATH_LEN];
+    struct stat st;
+    struct dirent *dp;
+    DIR *dir;
+    int reap = 0;
+
+    if (stat(parent_path(opts, file, LINGER_NAME), &st) < 0 || st.st_mtime > now)
+        return;
+
+    /* Claim the sweep: others will see nothing due until we're done. Any
+     * expiry set meanwhile is merged in when we're done. */
+    if ((next = update_linger_marker(opts, LINGER_NEVER, 0)) > now) {
+        /* Someone beat us to it; put back what might have been merged since */
+        update_linger_marker(opts, next, 1);
+        return;
+    }
+    next = LINGER_NEVER;
+
+    if (opts->table) {
+        next = sweep_table(opts, skip_uid, now, &reap, rd);
+        goto done;
+    }
+
+    dir = opendir(opts->dir);
+    if (!dir) {
+        update_linger_marker(opts, now, 1);
+        return;
+    }
+
+    while ((dp = readdir(dir)) != NULL) {
+        char *end;
+        unsigned long uid;
+        int fd;
+
+        if (dp->d_name[0] != '.' || dp->d_name[1] < '0' || dp->d_name[1] > '9')
+            continue;
+        errno = 0;
+        uid = strtoul(dp->d_name + 1, &end, 10);
+        if (errno != 0 || *end != '\0' || uid == (unsigned long) skip_uid)
+            continue;
+
+        /* Only lingering dirs are of interest */
+        if (fstatat(dirfd(dir), dp->d_name + 1, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+
+        fd = openat(dirfd(dir), dp->d_name, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        /* A busy counter is being used, so isn't lingering anymore */
+        if (flock(fd, LOCK_EX | LOCK_NB) < 0 || fstat(fd, &st) < 0
+                || read_counter(fd) != 0) {
+            close(fd);
+            continue;
+        }
+
+        if (st.st_mtime > now) {
+            if (st.st_mtime < next)
+                next = st.st_mtime;
+        } else if (remove_runtime_dir(opts, AT_FDCWD, dp->d_name + 1, rd, &reap) < 0) {
+            log_error(rd, "Failed to remove lingering directory %s/%s",
+                      opts->dir, dp->d_name + 1);
+            write_counter(fd, -1);
+        }
+        close(fd);
+    }
+    closedir(dir);
+
+done:
+    update_linger_marker(opts, next, 1);
+    if (reap)
+        spawn_reaper(rd);
+}
+
+/* Decrement the counter of the session sd, removing the runtime directory when
+ * it reaches zero. The counter is opened relative to parentfd (the parent dir,
+ * or AT_FDCWD to go by path), and must be the one sd was counted in.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+release_counter(const struct rundir *rd, const struct options *opts, int parentfd,
+                const struct rundir_session *sd)
+{
+    const uid_t uid = sd->uid;
+    char file[MAX_PATH_LEN];
+    struct counter c;
+    int r;
+    int l = intlen(uid);
+    int count = 0;
+    int mine = 1;
+    int next;
+    int reap = 0;
+    struct timespec ts;
+
+    /* Construct the counter file path */
+    print_filename(opts, file, uid, l);
+
+    /* With the table, the lock is only needed if we're the last one */
+    if (opts->table && table_detach(opts, parentfd, sd)) {
+        return 0;
+    }
+
+    /* Open and lock the counter */
+    PROBE1(lock_start, uid);
+    phase_start(&ts);
+    r = counter_lock(rd, opts, parentfd, uid, file, &c);
+    phase_end(PHASE_LOCK, &ts);
+    PROBE2(lock_end, uid, r);
+    if (r < 0) {
+        log_error(rd, "Failed to open/lock counter file %s", file);
+        return -1;
+    }
+
+    /* If it was replaced (e.g. the parent dir was wiped), this session isn't
+     * counted in there, and there's nothing left to release */
+    if (c.dev != sd->dev || c.ino != sd->ino) {
+        log_info(rd, "Counter of uid %d was replaced since open session, not releasing",
+                 (int) uid);
+        r = 0;
+        goto done;
+    }
+
+    /* Read the current counter value */
+    count = counter_read(&c);
+    if (count < 0) {
+        /* -2 means directory is not usable, but not a failure */
+        r = (count == -2) ? 0 : -1;
+        if (r < 0) {
+            log_error(rd, "Failed to read counter from %s", file);
+        }
+        goto done;
+    }
+
+    /* Sessions that went away without closing no longer count. If ours is
+     * among them, it was already taken off the counter */
+    if (opts->registry) {
+        count = registry_prune(rd, c.fd, uid, count);
+        if (count < 0 || (sd->pid != 0 && (mine = registry_remove(c.fd, sd)) < 0)) {
+            log_error(rd, "Failed to update registry in %s", file);
+            r = -1;
+            goto done;
+        }
+    }
+
+    /* Decrement counter, ensuring it doesn't go below zero. This is done
+     * before removing the directory, so no one can join in meanwhile. */
+    PROBE2(counter_before, uid, count);
+    do {
+        next = (count > 0 && mine) ? count - 1 : count;
+    } while ((r = counter_write(&c, count, next)) > 0 && (count = counter_read(&c)) >= 0);
+    if (r < 0) {
+        log_error(rd, "Failed to update counter in %s", file);
+        goto done;
+    }
+    PROBE2(counter_after, uid, next);
+
+    /* If counter reaches zero, remove the runtime directory */
+    if (next == 0) {
+        /* Runtime dir name is the UID, i.e. the counter's name without the dot */
+        const char *name = file + opts->dir_len + 2;
+
+        if (opts->linger > 0) {
+            /* Keep it around for a while, in case the user comes back */
+            time_t expiry = time(NULL) + opts->linger;
+
+            if (counter_set_expiry(&c, expiry) < 0 || update_linger_marker(opts, expiry, 1) < 0) {
+                log_error(rd, "Failed to set expiry of %s: %m", file);
+            }
+        } else if (remove_runtime_dir(opts, parentfd, name, rd, &reap) < 0) {
+            log_error(rd, "Failed to remove directory %s/%s", opts->dir, name);
+            log_error(rd, "Error state encountered during directory removal");
+            /* Mark as not usable */
+            if (counter_write(&c, 0, -1) < 0) {
+                log_error(rd, "Failed to update counter in %s", file);
+            }
+            r = -1;
+        }
+    }
+
+done:
+    counter_unlock(&c);
+
+    if (reap > 0) {
+        spawn_reaper(rd);
+    }
+
+    return r;
+}
+
+void
+rundir_session_free(struct rundir_session *s)
+{
+    if (s == NULL)
+        return;
+    close(s->parentfd);
+    free(s->extra);
+    free(s);
+}
+
+const char *
+rundir_session_path(const struct rundir_session *s)
+{
+    return s->path;
+}
+
+const char *
+rundir_var_name(const struct rundir *rd)
+{
+    return rd->opts.var_name;
+}
+
+/* Release the session s, after the checks of rundir_release() */
+static int
+release(const struct rundir *rd, const struct rundir_session *s)
+{
+    const struct options *opts = &rd->opts;
+    const uid_t uid = s->uid;
+    int parentfd = s->parentfd;
+    struct timespec ts;
+    struct stat st;
+    int r;
+
+    /* Get length for uid as ascii string */
+    int l = intlen(uid);
+    if (l <= 0 || l > MAX_UID_LENGTH) {
+        log_error(rd, "Invalid UID length for uid %d", (int) uid);
+        return RUNDIR_BAD_UID;
+    }
+
+    /* Everything is relative to the parent dir from acquiring, unless it was
+     * removed meanwhile; then make sure there's one to go by path */
+    if (fstat(parentfd, &st) < 0 || st.st_nlink == 0) {
+        phase_start(&ts);
+        r = ensure_parent_dir(opts, rd);
+        phase_end(PHASE_PARENT, &ts);
+        if (!r) {
+            log_error(rd, "Failed to ensure parent directory exists");
+            return RUNDIR_ERR;
+        }
+        parentfd = AT_FDCWD;
+    }
+
+    r = release_counter(rd, opts, parentfd, s);
+    log_debug(rd, "Closed session for uid %d", (int) uid);
+
+    return (r == 0) ? RUNDIR_OK : RUNDIR_ERR;
+}
+
+int
+rundir_release(struct rundir_session *s)
+{
+    const struct rundir *rd = s->rd;
+    int r;
+
+    /* Already released (or never counted), nothing to do */
+    if (!s->counted)
+        return RUNDIR_OK;
+
+    /* Security check: must be root */
+    if (geteuid() != 0) {
+        log_error(rd, "Must be root to close session");
+        return RUNDIR_ERR;
+    }
+
+    /* User was resolved when acquiring, no need to go through NSS again */
+    timing_begin(&rd->opts);
+    timing.uid = s->uid;
+    timing.gid = s->gid;
+    timing.session = s->trace_id;
+    PROBE1(close_session_entry, (int) s->uid);
+    r = release(rd, s);
+    PROBE2(close_session_exit, (int) s->uid, r);
+    s->counted = 0;
+
+    timing_end(&rd->opts, "close", r);
+    return r;
+}
+
+/* Create directory name (path) in the parent dir if it doesn't exist, as root:
+ * credentials are process wide, so aren't switched. It is then handed over to
+ * the user through its fd, so it can't be swapped for something else
+ * meanwhile. The first session gets a dedicated tmpfs mounted there (first),
+ * which needs root as well, and with populate set, a copy of skel=.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+create_dir(const struct options *opts, const struct rundir *rd, int parentfd,
+           const char *name, const char *path, mode_t mode, uid_t uid, gid_t gid,
+           int first, int populate)
+{
+    int fd;
+
+    if (opts->tmpfs && first && mount_tmpfs(opts, rd, path, mode, uid, gid) < 0) {
+        return -1;
+    }
+
+    if (mkdirat(parentfd, name, mode) != 0 && errno != EEXIST) {
+        log_error(rd, "Failed to create directory %s: %m", path);
+        return -1;
+    }
+    fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        log_error(rd, "Failed to open directory %s: %m", path);
+        return -1;
+    }
+    if (first && populate)
+        copy_skel(opts, rd, fd, path, uid, gid);
+
+    /* Set proper ownership of the directory */
+    if (fchown(fd, uid, gid) < 0) {
+        log_error(rd, "Failed to set ownership of %s: %m", path);
+        /* Non-fatal error, continue */
+    }
+
+    /* Set proper permissions (user rwx only, unless umask= says otherwise) */
+    if (fchmod(fd, mode) < 0) {
+        log_error(rd, "Failed to set permissions on %s: %m", path);
+        /* Non-fatal error, continue */
+    }
+    close(fd);
+    return 0;
+}
+
+/* Set the paths of the extra dirs of s, from s->path.
+ * Returns 0 on success, -1 on error. */
+static int
+set_extra_paths(struct rundir_session *s)
+{
+    const struct options *opts = &s->rd->opts;
+    const char *name = s->path + opts->dir_len + 1;
+    char buf[MAX_NAME_LEN + 1];
+    size_t len = 0;
+    int i;
+
+    s->extra = malloc(opts->nb_extra * (opts->dir_len + MAX_NAME_LEN + 2));
+    if (s->extra == NULL)
+        return -1;
+    for (i = 0; i < opts->nb_extra; ++i)
+        len += sprintf(s->extra + len, "%s/%s", opts->dir,
+                       extra_name(&opts->extra[i], name, buf)) + 1;
+    return 0;
+}
+
+/* Acquire the runtime directory of user (resolved through NSS), or if NULL
+ * of uid/gid, after the checks of acquire() */
+static int
+do_acquire(const struct rundir *rd, const char *user, uid_t uid, gid_t gid,
+           struct rundir_session **session)
+{
+    const struct options *opts = &rd->opts;
+    struct rundir_session *s;
+    char file[MAX_PATH_LEN];
+    struct counter c;
+    struct timespec ts;
+    const char *extra;
+    int pool_low = 0;
+    int count = 0;
+    int old;
+    int parentfd;
+    int i;
+    int l;
+    int r;
+
+    /* Get user info */
+    if (user != NULL) {
+        phase_start(&ts);
+        r = lookup_user(rd, opts, user, &uid, &gid);
+        phase_end(PHASE_NSS, &ts);
+        if (r < 0) {
+            return RUNDIR_NO_USER;
+        }
+    }
+    timing.uid = uid;
+    timing.gid = gid;
+
+    /* Get length for uid as ascii string */
+    l = intlen(uid);
+    if (l <= 0 || l > MAX_UID_LENGTH) {
+        log_error(rd, "Invalid UID length for uid %d", (int) uid);
+        return RUNDIR_BAD_UID;
+    }
+
+    /* Ensure the parent directory exists */
+    phase_start(&ts);
+    r = ensure_parent_dir(opts, rd);
+    phase_end(PHASE_PARENT, &ts);
+    if (!r) {
+        log_error(rd, "Failed to ensure parent directory exists");
+        return RUNDIR_ERR;
+    }
+
+    /* Kept in the session, for release to work relative to it */
+    parentfd = open(opts->dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (parentfd < 0) {
+        log_error(rd, "Failed to open directory %s: %m", opts->dir);
+        return RUNDIR_ERR;
+    }
+    s = malloc(sizeof(*s));
+    if (s == NULL) {
+        log_error(rd, "Memory allocation failed");
+        close(parentfd);
+        return RUNDIR_ERR;
+    }
+    s->rd = rd;
+    s->uid = uid;
+    s->gid = gid;
+    s->parentfd = parentfd;
+    s->counted = 0;
+    s->trace_id = 0;
+    if (opts->trace > 0)
+        s->trace_id = new_trace_id();
+    s->pid = 0;
+    s->start = 0;
+    s->extra = NULL;
+
+    /* Pick up after a reaper that couldn't finish (or start) */
+    if (opts->defer_cleanup && trash_pending(opts)) {
+        spawn_reaper(rd);
+    }
+
+    /* Expired lingering directories are removed lazily, by whoever comes next */
+    if (opts->linger > 0) {
+        sweep_lingering(opts, uid, rd);
+    }
+
+    /* Construct the counter file path */
+    print_filename(opts, file, uid, l);
+
+    /* Construct runtime dir name by removing the dot before UID */
+    memcpy(s->path, file, opts->dir_len + 1);
+    memcpy(s->path + opts->dir_len + 1, file + opts->dir_len + 2, l + 1);
+    if (opts->nb_extra > 0 && set_extra_paths(s) < 0) {
+        log_error(rd, "Memory allocation failed");
+        rundir_session_free(s);
+        return RUNDIR_ERR;
+    }
+
+    /* With the table, joining sessions already using the directory doesn't
+     * need the lock */
+    if (opts->table && table_attach(opts, s, file + opts->dir_len + 2)) {
+        log_debug(rd, "Joined sessions of uid %d in %s", (int) uid, s->path);
+        s->counted = 1;
+        timing.session = s->trace_id;
+        *session = s;
+        return RUNDIR_OK;
+    }
+
+    /* Open and lock the counter */
+    PROBE1(lock_start, uid);
+    phase_start(&ts);
+    r = counter_lock(rd, opts, parentfd, uid, file, &c);
+    phase_end(PHASE_LOCK, &ts);
+    PROBE2(lock_end, uid, r);
+    if (r < 0) {
+        log_error(rd, "Failed to open/lock counter file %s", file);
+        rundir_session_free(s);
+        return RUNDIR_ERR;
+    }
+    s->dev = c.dev;
+    s->ino = c.ino;
+
+    /* Read the current counter value, which is what it's updated from (old) */
+    old = count = counter_read(&c);
+    if (count < 0) {
+        /* -2 means directory is not usable, but not a failure */
+        if (count != -2) {
+            log_error(rd, "Failed to read counter from %s", file);
+            r = RUNDIR_ERR;
+            goto done;
+        }
+        count = 0; /* Start fresh if directory was not usable */
+        if (opts->registry)
+            registry_reset(c.fd);
+    }
+
+    /* Sessions that went away without closing no longer count; when none is
+     * left, what they left behind is removed before starting afresh */
+    if (opts->registry && count > 0) {
+        int reap = 0;
+
+        r = registry_prune(rd, c.fd, uid, count);
+        if (r < 0) {
+            log_error(rd, "Failed to update registry in %s", file);
+            r = RUNDIR_ERR;
+            goto done;
+        }
+        if (r == 0 && remove_runtime_dir(opts, parentfd, file + opts->dir_len + 2, rd, &reap) < 0)
+            log_error(rd, "Failed to remove directory %s", s->path);
+        if (reap)
+            spawn_reaper(rd);
+        old = count = r;
+    }
+
+    /* Increment the counter first to maintain consistency */
+    PROBE2(counter_before, uid, count);
+    while ((r = counter_write(&c, old, count + 1)) > 0) {
+        /* Changed meanwhile (with the table, sessions may join) */
+        old = count = counter_read(&c);
+        if (count < 0)
+            count = 0;
+    }
+    if (r < 0) {
+        log_error(rd, "Failed to update counter in %s", file);
+        r = RUNDIR_ERR;
+        goto done;
+    }
+    PROBE2(counter_after, uid, count + 1);
+
+    /* Register the session, so that it stops counting should its process go
+     * away without releasing it. If that can't be done, it is just counted */
+    if (opts->registry) {
+        s->pid = getpid();
+        s->start = process_start(s->pid);
+        if (registry_add(c.fd, s) < 0) {
+            log_info(rd, "Failed to register session of uid %d in %s", (int) uid, file);
+            s->pid = 0;
+        }
+    }
+
+    /* Joining sessions already using the directory have nothing to do, unless
+     * it isn't as it should be, then it's created/fixed as usual */
+    if (count > 0 && runtime_dir_ready(s, file + opts->dir_len + 2)) {
+        log_debug(rd, "Opened session %d of uid %d in %s", count + 1, (int) uid, s->path);
+        r = RUNDIR_OK;
+        goto done;
+    }
+
+    /* Create the runtime directory, then the extra ones, all covered by the
+     * same counter and lock */
+    phase_start(&ts);
+    if (opts->pool > 0 && take_from_pool(opts, rd, parentfd, file + opts->dir_len + 2,
+                                         s->path, uid, gid, count == 0, &pool_low) == 0) {
+        log_debug(rd, "Took %s from the pool", s->path);
+    } else if (create_dir(opts, rd, parentfd, file + opts->dir_len + 2, s->path, opts->mode,
+                          uid, gid, count == 0, opts->skel[0] != '\0') < 0) {
+        goto revert_counter;
+    }
+    for (i = 0, extra = s->extra; i < opts->nb_extra; ++i, extra += strlen(extra) + 1) {
+        if (create_dir(opts, rd, parentfd, extra + opts->dir_len + 1, extra,
+                       opts->extra[i].mode, uid, gid, count == 0, 0) < 0)
+            goto revert_counter;
+    }
+
+    /* Success path */
+    phase_end(PHASE_CREATE, &ts);
+    log_debug(rd, "Opened session %d of uid %d in %s", count + 1, (int) uid, s->path);
+    r = RUNDIR_OK;
+    goto done;
+
+revert_counter:
+    /* If we incremented the counter but failed afterward, decrement it. With
+     * the table, sessions might have joined in meanwhile. */
+    if (s->pid != 0)
+        registry_remove(c.fd, s);
+    while ((r = counter_write(&c, count + 1, count)) > 0) {
+        count = counter_read(&c) - 1;
+    }
+    if (r < 0) {
+        log_error(rd, "Failed to revert counter in %s", file);
+        /* Continue anyway */
+    }
+    r = RUNDIR_ERR;
+
+done:
+    /* Release the counter (and its lock) */
+    counter_unlock(&c);
+    if (pool_low)
+        spawn_reaper(rd);
+
+    if (r == RUNDIR_OK) {
+        s->counted = 1;
+        timing.session = s->trace_id;
+        *session = s;
+    } else {
+        rundir_session_free(s);
+    }
+    return r;
+}
+
+int
+rundir_extra_count(const struct rundir *rd)
+{
+    return rd->opts.nb_extra;
+}
+
+const char *
+rundir_extra_var_name(const struct rundir *rd, int i)
+{
+    return rd->opts.extra[i].var_name;
+}
+
+const char *
+rundir_session_extra_path(const struct rundir_session *s, int i)
+{
+    const char *path = s->extra;
+
+    while (i-- > 0)
+        path += strlen(path) + 1;
+    return path;
+}
+
+/* Checks, probes and timing common to rundir_acquire*() */
+static int
+acquire(const struct rundir *rd, const char *user, uid_t uid, gid_t gid,
+        struct rundir_session **session)
+{
+    int r;
+
+    /* Security check: must be root */
+    if (geteuid() != 0) {
+        log_error(rd, "Must be root to open session");
+        return RUNDIR_ERR;
+    }
+
+    timing_begin(&rd->opts);
+    PROBE(open_session_entry);
+    r = do_acquire(rd, user, uid, gid, session);
+    PROBE2(open_session_exit, (int) timing.uid, r);
+    timing_end(&rd->opts, "open", r);
+    return r;
+}
+
+int
+rundir_acquire(const struct rundir *rd, uid_t uid, gid_t gid,
+               struct rundir_session **session)
+{
+    return acquire(rd, NULL, uid, gid, session);
+}
+
+int
+rundir_acquire_user(const struct rundir *rd, const char *user,
+                    struct rundir_session **session)
+{
+    return acquire(rd, user, 0, 0, session);
+}
+
+/* Groups of the session's user, resolved on the first group: rule */
+struct user_groups {
+    int resolved;                  /* 1 once looked up, -1 if that failed */
+    gid_t *gids;
+    int count;
+    gid_t buf[MAX_GROUPS];
+};
+
+/* Look up user's groups (primary and supplementary) into g */
+static void
+resolve_groups(const struct rundir *rd, const char *user, struct user_groups *g)
+{
+    uid_t uid;
+    gid_t gid;
+    int n = MAX_GROUPS;
+
+    g->resolved = -1;
+    if (lookup_user(rd, &rd->opts, user, &uid, &gid) < 0)
+        return;
+    g->gids = g->buf;
+    if (getgrouplist(user, gid, g->gids, &n) < 0) {
+        gid_t *gids = malloc(n * sizeof(*gids));
+
+        if (gids == NULL || getgrouplist(user, gid, gids, &n) < 0) {
+            /* Don't fail, there's always the primary group */
+            free(gids);
+            g->buf[0] = gid;
+            n = 1;
+        } else {
+            g->gids = gids;
+        }
+    }
+    g->count = n;
+    g->resolved = 1;
+}
+
+/* Whether rule matches the session */
+static int
+rule_matches(const struct rundir *rd, const struct rule *rule, const char *service,
+             const char *tty, const char *user, struct user_groups *g)
+{
+    const char *pattern = rd->opts.rules.buf + rule->pattern;
+    int i;
+
+    switch (rule->key) {
+        case RULE_SERVICE:
+            return service && fnmatch(pattern, service, 0) == 0;
+        case RULE_TTY:
+            return tty && fnmatch(pattern, tty, 0) == 0;
+        case RULE_USER:
+            return user && fnmatch(pattern, user, 0) == 0;
+        case RULE_GROUP:
+            if (!user)
+                return 0;
+            if (!g->resolved)
+                resolve_groups(rd, user, g);
+            for (i = 0; g->resolved > 0 && i < g->count; ++i)
+                if (g->gids[i] == rule->gid)
+                    return 1;
+            return 0;
+    }
+    return 0;
+}
+
+int
+rundir_match(const struct rundir *rd, const char *service, const char *tty,
+             const char *user)
+{
+    const struct rules *rules = &rd->opts.rules;
+    struct user_groups g = { .resolved = 0 };
+    int include = (rules->includes == 0);
+    int excluded = 0;
+    int pass;
+    int i;
+
+    /* Service, tty and user patterns only compare strings, so they go first;
+     * groups are only looked up if still needed after them */
+    for (pass = 0; pass < 2 && !excluded; ++pass) {
+        for (i = 0; i < rules->count; ++i) {
+            const struct rule *rule = &rules->rule[i];
+
+            if ((rule->key == RULE_GROUP) != pass || (!rule->exclude && include))
+                continue;
+            if (rule_matches(rd, rule, service, tty, user, &g)) {
+                if (rule->exclude) {
+                    excluded = 1;
+                    break;
+                }
+                include = 1;
+            }
+        }
+    }
+    if (excluded)
+        include = 0;
+    if (g.resolved > 0 && g.gids != g.buf)
+        free(g.gids);
+
+    if (!include)
+        log_debug(rd, "Skipping session of %s (service %s, tty %s): not matched by include=/exclude=",
+                  user ? user : "?", service ? service : "?", tty ? tty : "?");
+    return include;
+}
+
+/* Prefix of the names of pool entries of the current mode */
+static int
+pool_prefix(const struct options *opts, char *buf, size_t size)
+{
+    return snprintf(buf, size, "%o.", (unsigned) opts->mode);
+}
+
+/* Take a directory from the pool as runtime directory name (in the parent
+ * dir), handing it over to uid:gid: a rename, then a chown. It is moved first,
+ * so that no one else can take it meanwhile; under the counter lock, no one
+ * else uses name either. Only entries of the current mode are taken. As with
+ * create_dir(), the skeleton is only copied in for the first session. low is
+ * set when the pool is down to half of pool= (a single getdents64 tells), so
+ * that it's refilled.
+ * Returns 0 on success, -1 if none could be taken, then it's created as usual.
+ */
+static int
+take_from_pool(const struct options *opts, const struct rundir *rd, int parentfd,
+               const char *name, const char *path, uid_t uid, gid_t gid, int first,
+               int *low)
+{
+    char buf[POOL_BUF] __attribute__((aligned(8)));
+    char prefix[16];
+    int entries = 0;
+    int taken = 0;
+    int r = -1;
+    int fd;
+    int l;
+    long n;
+    long off;
+
+    /* Only root can create it, as the parent dir is checked */
+    fd = openat(parentfd, POOL_NAME, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        *low = 1;
+        return -1;
+    }
+    do { n = syscall(SYS_getdents64, fd, buf, sizeof(buf)); }
+    while (n < 0 && errno == EINTR);
+
+    l = pool_prefix(opts, prefix, sizeof(prefix));
+    for (off = 0; off < n; ) {
+        const struct linux_dirent64 *d = (const struct linux_dirent64 *) (buf + off);
+
+        off += d->d_reclen;
+        if (d->d_name[0] == '.')
+            continue;
+        ++entries;
+        if (taken || strncmp(d->d_name, prefix, l) != 0)
+            continue;
+        if (renameat2(fd, d->d_name, parentfd, name, RENAME_NOREPLACE) == 0) {
+            taken = 1;
+        } else if (errno != ENOENT) {
+            /* EEXIST: it's to be fixed up instead */
+            break;
+        }
+    }
+    close(fd);
+
+    if (taken) {
+        --entries;
+        /* The skeleton goes in first, as with a directory created */
+        if (first && opts->skel[0] != '\0') {
+            fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0) {
+                copy_skel(opts, rd, fd, path, uid, gid);
+                close(fd);
+            }
+        }
+        if (fchownat(parentfd, name, uid, gid, AT_SYMLINK_NOFOLLOW) == 0)
+            r = 0;
+        else
+            log_error(rd, "Failed to set ownership of %s: %m", path);
+    }
+    /* Unless the buffer was (about) full, all entries were seen */
+    if (n >= 0 && (size_t) n + 256 <= sizeof(buf) && entries * 2 <= opts->pool)
+        *low = 1;
+    return r;
+}
+
+/* Counting pool entries of the current mode, removing others (made before it
+ * was changed) */
+struct pool_scan {
+    char prefix[16];
+    int l;
+    long count;
+};
+
+static void
+pool_scan_entry(int fd, const char *name, unsigned char type, void *data)
+{
+    struct pool_scan *scan = data;
+
+    if (name[0] == '.')
+        return;
+    if (type == DT_DIR && strncmp(name, scan->prefix, scan->l) == 0)
+        ++scan->count;
+    else
+        unlinkat(fd, name, (type == DT_DIR) ? AT_REMOVEDIR : 0);
+}
+
+/* Fill the pool up to pool= empty directories, owned by root, and of the mode
+ * of runtime directories. Only one process does it at a time, others leave.
+ * Returns the number of directories added.
+ */
+static long
+fill_pool(const struct options *opts, const struct rundir *rd)
+{
+    struct pool_scan scan;
+    struct timespec ts;
+    char name[64];
+    long added = 0;
+    int parentfd;
+    int fd;
+
+    parentfd = open(opts->dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (parentfd < 0)
+        return 0;
+    fd = open_root_dir(opts, parentfd, POOL_NAME, rd);
+    close(parentfd);
+    if (fd < 0)
+        return 0;
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        close(fd);
+        return 0;
+    }
+
+    scan.l = pool_prefix(opts, scan.prefix, sizeof(scan.prefix));
+    scan.count = 0;
+    if (list_dir(fd, pool_scan_entry, &scan) < 0) {
+        log_error(rd, "Failed to list directory %s/%s: %m", opts->dir, POOL_NAME);
+        goto done;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    for (; scan.count + added < opts->pool; ++added) {
+        snprintf(name, sizeof(name), "%s%lx%08lx.%x.%lx", scan.prefix,
+                 (unsigned long) ts.tv_sec, (unsigned long) ts.tv_nsec,
+                 (unsigned) getpid(), (unsigned long) added);
+        /* Not to depend on the umask */
+        if (mkdirat(fd, name, S_IRWXU) < 0 || fchmodat(fd, name, opts->mode, 0) < 0) {
+            log_error(rd, "Failed to create directory %s/%s/%s: %m", opts->dir, POOL_NAME, name);
+            unlinkat(fd, name, AT_REMOVEDIR);
+            break;
+        }
+    }
+
+done:
+    flock(fd, LOCK_UN);
+    close(fd);
+    return added;
+}
+
+/* The uid name stands for, if printed as print_int() does (no sign, nor
+ * leading zeroes), else -1 */
+static long long
+parse_uid(const char *name)
+{
+    long long uid = 0;
+    const char *s;
+
+    if (name[0] == '0' && name[1] != '\0')
+        return -1;
+    for (s = name; *s != '\0'; ++s) {
+        if (*s < '0' || *s > '9' || s - name >= MAX_UID_LENGTH)
+            return -1;
+        uid = uid * 10 + (*s - '0');
+    }
+    return (s == name || uid > INT_MAX) ? -1 : uid;
+}
+
+/* A growable list of uids */
+struct uid_list {
+    uint32_t *uids;
+    size_t n;
+    size_t size;
+    int failed;                    /* Memory allocation failed */
+};
+
+static void
+uid_list_add(struct uid_list *l, uint32_t uid)
+{
+    if (l->n == l->size) {
+        size_t size = l->size ? 2 * l->size : 256;
+        uint32_t *uids = realloc(l->uids, size * sizeof(*uids));
+
+        if (uids == NULL) {
+            l->failed = 1;
+            return;
+        }
+        l->uids = uids;
+        l->size = size;
+    }
+    l->uids[l->n++] = uid;
+}
+
+static int
+cmp_uid(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* What gc_scan() collects from the parent dir */
+struct gc_scan {
+    struct uid_list dirs;          /* Runtime directories */
+    struct uid_list counters;      /* Counter files */
+    struct uid_list extras;        /* Extra dirs, if opts isn't NULL */
+    const struct options *opts;
+};
+
+/* The uid whose extra dir name is, or -1 if it isn't one (see extra_name()) */
+static long long
+parse_extra_uid(const struct options *opts, const char *name)
+{
+    char uid[MAX_UID_LENGTH + 1];
+    size_t l = strlen(name);
+    int i;
+
+    for (i = 0; i < opts->nb_extra; ++i) {
+        const struct extra_dir *e = &opts->extra[i];
+        const char *suffix = e->template + e->uid_at + 2;
+        size_t sl = strlen(suffix);
+
+        if (l <= e->uid_at + sl || l - e->uid_at - sl > MAX_UID_LENGTH
+                || strncmp(name, e->template, e->uid_at) != 0
+                || strcmp(name + l - sl, suffix) != 0)
+            continue;
+        memcpy(uid, name + e->uid_at, l - e->uid_at - sl);
+        uid[l - e->uid_at - sl] = '\0';
+        return parse_uid(uid);
+    }
+    return -1;
+}
+
+static void
+gc_scan_entry(int fd, const char *name, unsigned char type, void *data)
+{
+    struct gc_scan *scan = data;
+    const int counter = (name[0] == '.');
+    long long uid = parse_uid(name + counter);
+
+    (void)fd;
+    if (uid < 0) {
+        if (!counter && type == DT_DIR && scan->opts && scan->opts->nb_extra > 0
+                && (uid = parse_extra_uid(scan->opts, name)) >= 0)
+            uid_list_add(&scan->extras, (uint32_t) uid);
+        return;
+    }
+    if (counter && type == DT_REG)
+        uid_list_add(&scan->counters, (uint32_t) uid);
+    else if (!counter && type == DT_DIR)
+        uid_list_add(&scan->dirs, (uint32_t) uid);
+}
+
+static void
+count_tombstone(int fd, const char *name, unsigned char type, void *data)
+{
+    (void)fd;
+    (void)type;
+    if (name[0] != '.')
+        ++*(unsigned long *) data;
+}
+
+/* Check the runtime directory of uid, and unless it's in use (or lingering)
+ * move it and its extra dirs to the trash, setting reap. has_counter tells whether it had one
+ * when the parent dir was listed; if not, it gets one (at 0).
+ */
+static void
+gc_dir(const struct rundir *rd, const struct options *opts, int parentfd, uid_t uid,
+       int has_counter, int flags, struct rundir_gc_stats *stats, int *reap)
+{
+    char file[MAX_PATH_LEN];
+    const char *name;
+    struct counter c;
+    struct stat st;
+    time_t expiry = 0;
+    int count;
+
+    print_filename(opts, file, uid, intlen(uid));
+    name = file + opts->dir_len + 2;
+
+    if (!has_counter) {
+        ++stats->orphans;
+        /* Don't create its counter just to look at it */
+        if (flags & RUNDIR_GC_DRY_RUN)
+            return;
+    }
+
+    /* Not waiting: a locked counter is being used, so isn't an orphan */
+    if (counter_lock(NULL, opts, parentfd, uid, file, &c) < 0) {
+        ++stats->busy;
+        return;
+    }
+
+    count = counter_read(&c);
+    if (count > 0 && opts->registry && !(flags & RUNDIR_GC_DRY_RUN))
+        count = registry_prune(rd, c.fd, uid, count);
+    if (count != 0 && count != -2)
+        goto done;
+    if (has_counter)
+        ++stats->unused;
+
+    /* Expiries are honored even without linger=, it might be set elsewhere */
+    if (c.table)
+        expiry = (time_t) __atomic_load_n(&c.slot->expires, __ATOMIC_ACQUIRE);
+    else if (fstat(c.fd, &st) == 0)
+        expiry = st.st_mtime;
+    if (expiry > time(NULL)) {
+        ++stats->lingering;
+        goto done;
+    }
+    if (flags & RUNDIR_GC_DRY_RUN)
+        goto done;
+
+    if (do_remove_runtime_dir(opts, parentfd, name, rd, reap) < 0) {
+        log_error(rd, "Failed to remove orphaned directory %s/%s", opts->dir, name);
+        counter_write(&c, count, -1);
+        ++stats->failed;
+    } else {
+        log_debug(rd, "Removed orphaned directory %s/%s", opts->dir, name);
+        /* Gone, so usable again */
+        if (count == -2)
+            counter_write(&c, count, 0);
+        if (c.table)
+            __atomic_store_n(&c.slot->expires, 0, __ATOMIC_RELEASE);
+        ++stats->removed;
+    }
+
+done:
+    counter_unlock(&c);
+}
+
+int
+rundir_gc(const struct rundir *rd, int flags, struct rundir_gc_stats *stats)
+{
+    struct gc_scan scan = { { NULL, 0, 0, 0 }, { NULL, 0, 0, 0 }, { NULL, 0, 0, 0 }, NULL };
+    struct options opts = rd->opts;
+    size_t i, j;
+    int reap = 0;
+    int r = RUNDIR_ERR;
+    int parentfd;
+    int fd;
+
+    memset(stats, 0, sizeof(*stats));
+    if (geteuid() != 0) {
+        log_error(rd, "Must be root to collect orphans");
+        return RUNDIR_ERR;
+    }
+
+    /* The reaper of sessions (see spawn_reaper()), with their options */
+    if (flags & RUNDIR_GC_REAP_ONLY) {
+        if (!(flags & RUNDIR_GC_DRY_RUN)) {
+            stats->failed = reap_trash(&rd->opts, rd);
+            if (rd->opts.pool > 0)
+                stats->pooled = fill_pool(&rd->opts, rd);
+        }
+        return (stats->failed > 0) ? RUNDIR_ERR : RUNDIR_OK;
+    }
+
+    /* Orphans always go through the trash, to be removed in parallel once
+     * all counters are unlocked; and busy counters aren't waited for */
+    opts.defer_cleanup = 1;
+    opts.lock_timeout = 0;
+    scan.opts = &opts;
+
+    parentfd = open(opts.dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (parentfd < 0) {
+        if (errno == ENOENT)
+            return RUNDIR_OK;
+        log_error(rd, "Failed to open directory %s: %m", opts.dir);
+        return RUNDIR_ERR;
+    }
+
+    /* One pass over the parent dir; with the table, counters are its slots */
+    if (list_dir(parentfd, gc_scan_entry, &scan) < 0) {
+        log_error(rd, "Failed to list directory %s: %m", opts.dir);
+        goto cleanup;
+    }
+    if (opts.table) {
+        struct table_header *hdr;
+        struct table_slot *slots;
+        struct stat st;
+        uint32_t k;
+
+        scan.counters.n = 0;
+        hdr = table_map(&opts, parentfd, rd, &fd, &st);
+        if (!hdr)
+            goto cleanup;
+        slots = (struct table_slot *) (hdr + 1);
+        for (k = 0; k < TABLE_SLOTS; ++k) {
+            uint32_t key = __atomic_load_n(&slots[k].key, __ATOMIC_ACQUIRE);
+
+            if (key != 0)
+                uid_list_add(&scan.counters, key - 1);
+        }
+        table_unmap(hdr, fd);
+    }
+    if (scan.dirs.failed || scan.counters.failed || scan.extras.failed) {
+        log_error(rd, "Memory allocation failed");
+        goto cleanup;
+    }
+    stats->dirs = scan.dirs.n;
+    stats->counters = scan.counters.n;
+
+    /* Tombstones left behind, e.g. by a reaper that was killed */
+    fd = openat(parentfd, TRASH_NAME, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0) {
+        list_dir(fd, count_tombstone, &stats->tombstones);
+        close(fd);
+    }
+
+    /* Pair directories with their counters. Extra dirs count as the user's
+     * runtime dir, which may be gone already (e.g. after a crash between the
+     * removals, or extra_dir= was changed) */
+    if (scan.extras.n) {
+        for (i = 0; i < scan.extras.n; ++i)
+            uid_list_add(&scan.dirs, scan.extras.uids[i]);
+        if (scan.dirs.failed) {
+            log_error(rd, "Memory allocation failed");
+            goto cleanup;
+        }
+    }
+    if (scan.dirs.n)
+        qsort(scan.dirs.uids, scan.dirs.n, sizeof(uint32_t), cmp_uid);
+    if (scan.counters.n)
+        qsort(scan.counters.uids, scan.counters.n, sizeof(uint32_t), cmp_uid);
+    for (i = 0, j = 0; i < scan.dirs.n; ++i) {
+        const uint32_t uid = scan.dirs.uids[i];
+
+        if (i > 0 && scan.dirs.uids[i - 1] == uid)
+            continue;
+        while (j < scan.counters.n && scan.counters.uids[j] < uid)
+            ++j;
+        gc_dir(rd, &opts, parentfd, uid, j < scan.counters.n && scan.counters.uids[j] == uid,
+               flags, stats, &reap);
+    }
+
+    /* Counters are unlocked, now remove everything in the trash */
+    if (!(flags & RUNDIR_GC_DRY_RUN) && (reap || stats->tombstones > 0))
+        stats->failed += reap_trash(&opts, rd);
+    if (!(flags & RUNDIR_GC_DRY_RUN) && opts.pool > 0)
+        stats->pooled = fill_pool(&opts, rd);
+
+    log_debug(rd, "Collected %lu orphaned directories (%lu failed), %lu tombstones",
+              stats->removed, stats->failed, stats->tombstones);
+    r = (stats->failed > 0) ? RUNDIR_ERR : RUNDIR_OK;
+
+cleanup:
+    free(scan.dirs.uids);
+    free(scan.counters.uids);
+    free(scan.extras.uids);
+    close(parentfd);
+    return r;
+}
+
+/* Read the counter file of uid, without locking it: a record written over
+ * while being read fails its checksum, so is read again */
+static void
+status_read_file(int parentfd, struct rundir_status *st)
+{
+    char name[MAX_UID_LENGTH + 2];
+    struct stat sb;
+    int tries;
+    int fd;
+
+    snprintf(name, sizeof(name), ".%u", (unsigned) st->uid);
+    do { fd = openat(parentfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC); }
+    while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+        st->sessions = -1;
+        return;
+    }
+    for (tries = 0; tries < 3; ++tries)
+        if ((st->sessions = read_counter(fd)) != -1)
+            break;
+    if ((st->sessions == 0 || st->sessions == -2) && st->has_dir
+            && fstat(fd, &sb) == 0 && sb.st_mtime > time(NULL))
+        st->expires = sb.st_mtime;
+    close(fd);
+}
+
+int
+rundir_status(const struct rundir *rd, struct rundir_status **status, size_t *n)
+{
+    struct gc_scan scan = { { NULL, 0, 0, 0 }, { NULL, 0, 0, 0 }, { NULL, 0, 0, 0 }, NULL };
+    const struct options *opts = &rd->opts;
+    const size_t table_size = (TABLE_SLOTS + 1) * sizeof(struct table_slot);
+    struct table_header *hdr = NULL;
+    struct table_slot *slots = NULL;
+    struct rundir_status *list = NULL;
+    size_t i, j, k;
+    time_t now;
+    int r = RUNDIR_ERR;
+    int parentfd;
+    int fd;
+
+    *status = NULL;
+    *n = 0;
+    parentfd = open(opts->dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (parentfd < 0) {
+        if (errno == ENOENT)
+            return RUNDIR_OK;
+        log_error(rd, "Failed to open directory %s: %m", opts->dir);
+        return RUNDIR_ERR;
+    }
+
+    /* One pass over the parent dir; with the table, counters are its slots,
+     * mapped read-only */
+    if (list_dir(parentfd, gc_scan_entry, &scan) < 0) {
+        log_error(rd, "Failed to list directory %s: %m", opts->dir);
+        goto cleanup;
+    }
+    if (opts->table) {
+        uint32_t s;
+
+        scan.counters.n = 0;
+        fd = openat(parentfd, TABLE_NAME, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd >= 0) {
+            hdr = mmap(NULL, table_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (hdr == MAP_FAILED || hdr->magic != TABLE_MAGIC || hdr->version != TABLE_VERSION
+                    || hdr->slots != TABLE_SLOTS || hdr->slot_size != sizeof(struct table_slot)) {
+                log_error(rd, "Invalid table %s/%s", opts->dir, TABLE_NAME);
+                if (hdr != MAP_FAILED)
+                    munmap(hdr, table_size);
+                hdr = NULL;
+                goto cleanup;
+            }
+            slots = (struct table_slot *) (hdr + 1);
+            for (s = 0; s < TABLE_SLOTS; ++s) {
+                uint32_t key = __atomic_load_n(&slots[s].key, __ATOMIC_ACQUIRE);
+
+                if (key != 0)
+                    uid_list_add(&scan.counters, key - 1);
+            }
+        } else if (errno != ENOENT) {
+            log_error(rd, "Failed to open %s/%s: %m", opts->dir, TABLE_NAME);
+            goto cleanup;
+        }
+    }
+    if (scan.dirs.failed || scan.counters.failed) {
+        log_error(rd, "Memory allocation failed");
+        goto cleanup;
+    }
+
+    /* Merge directories and counters, by uid */
+    if (scan.dirs.n)
+        qsort(scan.dirs.uids, scan.dirs.n, sizeof(uint32_t), cmp_uid);
+    if (scan.counters.n)
+        qsort(scan.counters.uids, scan.counters.n, sizeof(uint32_t), cmp_uid);
+    list = malloc((scan.dirs.n + scan.counters.n + 1) * sizeof(*list));
+    if (list == NULL) {
+        log_error(rd, "Memory allocation failed");
+        goto cleanup;
+    }
+    now = time(NULL);
+    for (i = 0, j = 0, k = 0; i < scan.dirs.n || j < scan.counters.n; ++k) {
+        struct rundir_status *st = &list[k];
+
+        if (j == scan.counters.n || (i < scan.dirs.n && scan.dirs.uids[i] <= scan.counters.uids[j])) {
+            st->uid = scan.dirs.uids[i];
+            st->has_dir = 1;
+            st->has_counter = (j < scan.counters.n && scan.counters.uids[j] == st->uid);
+            ++i;
+            if (st->has_counter)
+                ++j;
+        } else {
+            st->uid = scan.counters.uids[j++];
+            st->has_dir = 0;
+            st->has_counter = 1;
+        }
+        st->sessions = 0;
+        st->expires = 0;
+        if (!st->has_counter)
+            continue;
+
+        if (slots) {
+            struct table_slot *slot = table_slot(hdr, st->uid, 0);
+            int32_t count = slot ? __atomic_load_n(&slot->count, __ATOMIC_ACQUIRE) : 0;
+            time_t expiry = slot ? (time_t) __atomic_load_n(&slot->expires, __ATOMIC_ACQUIRE) : 0;
+
+            st->sessions = (count < 0) ? -2 : count;
+            if (count <= 0 && st->has_dir && expiry > now)
+                st->expires = expiry;
+        } else {
+            status_read_file(parentfd, st);
+        }
+    }
+
+    *status = list;
+    *n = k;
+    r = RUNDIR_OK;
+
+cleanup:
+    if (hdr)
+        munmap(hdr, table_size);
+    free(scan.dirs.uids);
+    free(scan.counters.uids);
+    close(parentfd);
+    return r;
+}
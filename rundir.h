@@ -0,0 +1,144 @@
+/*
+ * pam_rundir - Copyright (C) 2015 Olivier Brunel
+ *
+ * rundir.h
+ * Copyright (C) 2015 Olivier Brunel <jjk@jjacky.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see http://www.gnu.org/licenses/
+ */
+
+/*
+ * librundir: runtime directories refcounted the same way as pam_rundir does,
+ * without going through PAM. Sessions of a user share their runtime directory,
+ * created by the first one and removed after the last one, with the same
+ * counters and locks as the PAM module, so both can be used side by side.
+ *
+ *   struct rundir *rd = rundir_new(argc, argv);   // e.g. { "dir=/run/user" }
+ *   struct rundir_session *s;
+ *
+ *   if (rundir_acquire(rd, uid, gid, &s) == RUNDIR_OK) {
+ *       setenv(rundir_var_name(rd), rundir_session_path(s), 1);
+ *       ...
+ *       rundir_release(s);
+ *       rundir_session_free(s);
+ *   }
+ *
+ * Everything must be done as root. A struct rundir must outlive its sessions;
+ * different sessions can be used from different threads at once. Errors are
+ * logged to syslog, as with the module.
+ */
+
+#ifndef RUNDIR_H
+#define RUNDIR_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/* Return values */
+#define RUNDIR_OK 0                /* Success */
+#define RUNDIR_ERR -1              /* Failure, see syslog */
+#define RUNDIR_NO_USER -2          /* User not found */
+#define RUNDIR_BAD_UID -3          /* uid can't be used */
+
+struct rundir;
+struct rundir_session;
+
+/* Parse options, as on the module's configuration line (see pam_rundir(8)).
+ * Returns NULL on error. */
+struct rundir *rundir_new(int argc, const char **argv);
+void rundir_free(struct rundir *rd);
+
+/* Take a reference on the runtime directory of uid/gid, creating it if needed;
+ * on success, *session is set. */
+int rundir_acquire(const struct rundir *rd, uid_t uid, gid_t gid,
+                   struct rundir_session **session);
+
+/* Same as rundir_acquire(), for user as resolved through NSS */
+int rundir_acquire_user(const struct rundir *rd, const char *user,
+                        struct rundir_session **session);
+
+/* Whether a session of user, opened through service on tty, is to be handled
+ * according to the include= and exclude= options: returns 1 if so, 0 if it
+ * is to be left alone. Any of those can be NULL when unknown, matching no
+ * rule on it. Only rules on groups need a lookup (of user's groups). */
+int rundir_match(const struct rundir *rd, const char *service, const char *tty,
+                 const char *user);
+
+/* Drop the reference of session, removing the runtime directory if it was the
+ * last one. Does nothing if already released. */
+int rundir_release(struct rundir_session *session);
+
+/* Free session. Unless released, its reference is kept (e.g. by a child
+ * process, to be released from there). */
+void rundir_session_free(struct rundir_session *session);
+
+/* Path of the runtime directory of session */
+const char *rundir_session_path(const struct rundir_session *session);
+
+/* Name of the environment variable to set (envvar=) */
+const char *rundir_var_name(const struct rundir *rd);
+
+/* Number of extra directories (extra_dir=), created and removed along with
+ * the runtime directory, and the environment variable of extra dir i */
+int rundir_extra_count(const struct rundir *rd);
+const char *rundir_extra_var_name(const struct rundir *rd, int i);
+
+/* Path of extra directory i of session */
+const char *rundir_session_extra_path(const struct rundir_session *session, int i);
+
+/* What rundir_gc() found, and removed */
+struct rundir_gc_stats {
+    unsigned long dirs;            /* Runtime directories */
+    unsigned long counters;        /* Counters, in use or not */
+    unsigned long orphans;         /* Directories without a counter */
+    unsigned long unused;          /* Directories whose counter is 0 (or unusable) */
+    unsigned long lingering;       /* Of those, not expired yet; kept */
+    unsigned long busy;            /* Skipped, their counter being locked */
+    unsigned long tombstones;      /* Leftovers found in the trash */
+    unsigned long removed;         /* Orphans and unused directories removed */
+    unsigned long failed;          /* Those that couldn't be, tombstones included */
+    unsigned long pooled;          /* Directories added to the pool (pool=) */
+};
+
+/* Flags of rundir_gc() */
+#define RUNDIR_GC_DRY_RUN 0x1      /* Only report, don't remove anything */
+#define RUNDIR_GC_REAP_ONLY 0x2    /* Only empty the trash and refill the pool, as
+                                    * the reaper of sessions does */
+
+/* Remove what sessions left behind in the parent dir: runtime directories no
+ * session uses, and tombstones. Directories are moved to the trash under their
+ * counter's lock, then the trash is emptied (with reaper_threads= threads).
+ * With pool=, the pool is then refilled. Returns RUNDIR_ERR if anything
+ * couldn't be removed. */
+int rundir_gc(const struct rundir *rd, int flags, struct rundir_gc_stats *stats);
+
+/* State of a user's runtime directory, as read by rundir_status() */
+struct rundir_status {
+    uid_t uid;
+    int sessions;                  /* Open sessions, -2 if unusable, -1 if the counter
+                                      can't be read; 0 without a counter */
+    int has_counter;
+    int has_dir;                   /* The runtime directory exists */
+    time_t expires;                /* Unused and lingering until then, else 0 */
+};
+
+/* Read the state of all users with a counter or a runtime directory, without
+ * taking any lock (so it never waits for, nor delays, sessions): *status is set
+ * to an array of *n of them, sorted by uid, to be free()d. Counters are read
+ * atomically, checksummed records being read again if caught mid-update. Root
+ * isn't needed, only read access to the parent dir and counters.
+ * Returns RUNDIR_OK, or RUNDIR_ERR. */
+int rundir_status(const struct rundir *rd, struct rundir_status **status, size_t *n);
+
+#endif /* RUNDIR_H */
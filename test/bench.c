@@ -0,0 +1,371 @@
+/*
+ * pam_rundir - Copyright (C) 2015 Olivier Brunel
+ *
+ * test/bench.c
+ * Latency benchmark of open/close session, loading pam_rundir.so through
+ * libpam with a private service file.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see http://www.gnu.org/licenses/
+ */
+
+/*
+ * Usage: bench [OPTION]... MODULE SCENARIO
+ *
+ * Runs WORKERS processes, each opening and closing SESSIONS sessions, all
+ * started at once, then prints one line per operation with its latency
+ * percentiles, e.g.:
+ *
+ *   bench scenario=uids op=open count=4000 errors=0 p50_us=41 p99_us=180 ...
+ *
+ * Scenarios:
+ *   contention  every session is for the same user (-U, default root)
+ *   uids        sessions are spread over USERS distinct users
+ *   teardown    as contention, but FILES files are created in the runtime
+ *               directory before closing, so the last close removes a tree
+ *   nss         as uids, with user lookups slowed down by DELAY microseconds
+ *
+ * Distinct users and slow lookups are provided by bench_nss.so, which must be
+ * preloaded (see `make bench`): users BENCH_USER_PREFIX0, 1, ... don't need to
+ * exist, they are given uid/gid BENCH_UID_BASE + N.
+ *
+ * Options:
+ *   -w WORKERS   concurrent worker processes [8]
+ *   -u USERS     distinct users, for uids and nss [1000]
+ *   -n SESSIONS  sessions per worker [500]
+ *   -t FILES     files created per session, for teardown [1000]
+ *   -l DELAY     lookup delay in microseconds, for nss [1000]
+ *   -U USER      user for contention and teardown [root]
+ *   -o OPTIONS   module options, appended after dir= and reaper= (the
+ *                rundir-gc next to MODULE)
+ *
+ * Must be run as root, as the module. Everything happens in a temporary
+ * directory (service file, and dir= of the module), removed afterwards.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <security/pam_appl.h>
+#include <ftw.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bench.h"
+
+#define SERVICE "rundir-bench"
+
+enum scenario { CONTENTION, UIDS, TEARDOWN, NSS };
+static const char *scenarios[] = { "contention", "uids", "teardown", "nss" };
+
+struct config {
+    enum scenario scenario;
+    long workers;
+    long users;
+    long sessions;
+    long files;
+    long delay;
+    const char *user;
+};
+
+/* Latencies of one operation, in nanoseconds, shared with workers; NOT_RUN if
+ * it wasn't attempted (close after a failed open), else negative on error. */
+#define NOT_RUN INT64_MIN
+struct results {
+    int64_t *open;
+    int64_t *close;
+};
+
+static int
+conv(int n, const struct pam_message **msg, struct pam_response **resp, void *data)
+{
+    (void)n;
+    (void)msg;
+    (void)resp;
+    (void)data;
+    return PAM_CONV_ERR;
+}
+
+static int64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static int
+remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)ftw;
+    return (type == FTW_DP) ? rmdir(path) : unlink(path);
+}
+
+/* Create files files in the runtime directory dir, 100 per subdirectory */
+static void
+populate(const char *dir, long files)
+{
+    char path[PATH_MAX];
+    long i;
+    int fd;
+
+    for (i = 0; i < files; ++i) {
+        if (i % 100 == 0) {
+            snprintf(path, sizeof(path), "%s/d%ld", dir, i / 100);
+            mkdir(path, 0700);
+        }
+        snprintf(path, sizeof(path), "%s/d%ld/f%ld", dir, i / 100, i % 100);
+        fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+        if (fd >= 0) {
+            write(fd, path, strlen(path));
+            close(fd);
+        }
+    }
+}
+
+/* Open and close cfg->sessions sessions, recording latencies at slot */
+static void
+worker(const struct config *cfg, const char *confdir, long w, struct results *res)
+{
+    struct pam_conv c = { conv, NULL };
+    char user[64];
+    long i;
+
+    for (i = 0; i < cfg->sessions; ++i) {
+        const long slot = w * cfg->sessions + i;
+        pam_handle_t *h;
+        const char *dir;
+        int64_t start;
+        int r;
+
+        if (cfg->scenario == UIDS || cfg->scenario == NSS)
+            snprintf(user, sizeof(user), "%s%ld", BENCH_USER_PREFIX, slot % cfg->users);
+        else
+            snprintf(user, sizeof(user), "%s", cfg->user);
+
+        res->open[slot] = -1;
+        res->close[slot] = NOT_RUN;
+        if (pam_start_confdir(SERVICE, user, &c, confdir, &h) != PAM_SUCCESS)
+            continue;
+
+        start = now_ns();
+        r = pam_open_session(h, 0);
+        if (r == PAM_SUCCESS) {
+            res->open[slot] = now_ns() - start;
+            res->close[slot] = -1;
+
+            dir = pam_getenv(h, "XDG_RUNTIME_DIR");
+            if (cfg->scenario == TEARDOWN && dir != NULL)
+                populate(dir, cfg->files);
+
+            start = now_ns();
+            r = pam_close_session(h, 0);
+            if (r == PAM_SUCCESS)
+                res->close[slot] = now_ns() - start;
+        }
+        pam_end(h, r);
+    }
+}
+
+/* Sort the n latencies in lat and print their percentiles */
+static void
+report(const struct config *cfg, const char *op, int64_t *lat, long n)
+{
+    long errors = 0;
+    long count = 0;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        if (lat[i] >= 0)
+            lat[count++] = lat[i];
+        else if (lat[i] != NOT_RUN)
+            ++errors;
+    }
+    qsort(lat, count, sizeof(*lat), cmp_int64);
+
+#define PCT(p) (count ? lat[(long) ((count - 1) * (p))] / 1000 : 0)
+    printf("bench scenario=%s op=%s count=%ld errors=%ld"
+           " p50_us=%lld p99_us=%lld p999_us=%lld max_us=%lld\n",
+           scenarios[cfg->scenario], op, count, errors,
+           (long long) PCT(0.5), (long long) PCT(0.99), (long long) PCT(0.999),
+           (long long) PCT(1.0));
+#undef PCT
+}
+
+static void
+usage(int status)
+{
+    fprintf(status ? stderr : stdout,
+            "Usage: bench [-w WORKERS] [-u USERS] [-n SESSIONS] [-t FILES]"
+            " [-l DELAY] [-U USER] [-o OPTIONS] MODULE SCENARIO\n"
+            "Scenarios: contention, uids, teardown, nss\n");
+    exit(status);
+}
+
+static long
+parse_long(const char *s)
+{
+    char *end;
+    long v;
+
+    errno = 0;
+    v = strtol(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || v <= 0)
+        usage(1);
+    return v;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct config cfg = { CONTENTION, 8, 1000, 500, 1000, 1000, "root" };
+    struct timespec ts = { 0, 100000000 };
+    char confdir[] = "/tmp/pam_rundir_bench.XXXXXX";
+    char module[PATH_MAX];
+    char path[PATH_MAX + 32];
+    const char *options = "";
+    struct results res;
+    int64_t start, elapsed;
+    int pipefd[2];
+    size_t size;
+    long total;
+    long w;
+    FILE *f;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "hw:u:n:t:l:U:o:")) != -1) {
+        switch (opt) {
+            case 'w': cfg.workers = parse_long(optarg); break;
+            case 'u': cfg.users = parse_long(optarg); break;
+            case 'n': cfg.sessions = parse_long(optarg); break;
+            case 't': cfg.files = parse_long(optarg); break;
+            case 'l': cfg.delay = parse_long(optarg); break;
+            case 'U': cfg.user = optarg; break;
+            case 'o': options = optarg; break;
+            case 'h': usage(0); break;
+            default: usage(1);
+        }
+    }
+    if (argc - optind != 2)
+        usage(1);
+    if (realpath(argv[optind], module) == NULL) {
+        fprintf(stderr, "bench: %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    for (opt = 0; opt < (int) (sizeof(scenarios) / sizeof(*scenarios)); ++opt)
+        if (strcmp(argv[optind + 1], scenarios[opt]) == 0)
+            break;
+    if (opt == (int) (sizeof(scenarios) / sizeof(*scenarios)))
+        usage(1);
+    cfg.scenario = opt;
+
+    if (geteuid() != 0) {
+        fprintf(stderr, "bench: must be run as root\n");
+        return 1;
+    }
+    if (cfg.scenario == NSS) {
+        snprintf(path, sizeof(path), "%ld", cfg.delay);
+        setenv(BENCH_DELAY_ENV, path, 1);
+    }
+
+    /* Private service file, with dir= inside our temporary directory */
+    if (mkdtemp(confdir) == NULL) {
+        perror("bench: mkdtemp");
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/%s", confdir, SERVICE);
+    f = fopen(path, "w");
+    if (f == NULL) {
+        perror("bench: fopen");
+        return 1;
+    }
+    fprintf(f, "session required %s dir=%s/run reaper=%.*s/rundir-gc %s\n", module, confdir,
+            (int) (strrchr(module, '/') - module), module, options);
+    fclose(f);
+
+    total = cfg.workers * cfg.sessions;
+    size = 2 * total * sizeof(int64_t);
+    res.open = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (res.open == MAP_FAILED) {
+        perror("bench: mmap");
+        return 1;
+    }
+    res.close = res.open + total;
+
+    /* Workers all start once the pipe is closed */
+    if (pipe(pipefd) < 0) {
+        perror("bench: pipe");
+        return 1;
+    }
+    for (w = 0; w < cfg.workers; ++w) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            perror("bench: fork");
+            return 1;
+        } else if (pid == 0) {
+            char c;
+
+            close(pipefd[1]);
+            while (read(pipefd[0], &c, 1) < 0 && errno == EINTR)
+                ;
+            worker(&cfg, confdir, w, &res);
+            _exit(0);
+        }
+    }
+    close(pipefd[0]);
+    start = now_ns();
+    close(pipefd[1]);
+    while (wait(NULL) > 0 || errno == EINTR)
+        ;
+    elapsed = now_ns() - start;
+
+    printf("bench scenario=%s workers=%ld users=%ld sessions=%ld elapsed_ms=%lld"
+           " sessions_per_s=%.0f\n",
+           scenarios[cfg.scenario], cfg.workers,
+           (cfg.scenario == UIDS || cfg.scenario == NSS) ? cfg.users : 1,
+           total, (long long) (elapsed / 1000000),
+           (double) total * 1e9 / (double) (elapsed ? elapsed : 1));
+    report(&cfg, "open", res.open, total);
+    report(&cfg, "close", res.close, total);
+
+    /* A reaper (see reaper=) may still be at work in there, and recreate what
+     * was just removed: try again for up to 5 seconds */
+    for (i = 0; i < 50; ++i) {
+        nftw(confdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+        if (access(confdir, F_OK) < 0)
+            break;
+        nanosleep(&ts, NULL);
+    }
+    return 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * pam_rundir - Copyright (C) 2015 Olivier Brunel
+ *
+ * test/bench.h
+ * Shared between the benchmark and its NSS shim.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see http://www.gnu.org/licenses/
+ */
+
+#ifndef PAM_RUNDIR_BENCH_H
+#define PAM_RUNDIR_BENCH_H
+
+#define BENCH_USER_PREFIX "rundirbench"   /* Users served by bench_nss.so */
+#define BENCH_UID_BASE 200000             /* uid/gid of BENCH_USER_PREFIX0 */
+#define BENCH_DELAY_ENV "BENCH_NSS_DELAY_US" /* Lookup delay, in microseconds */
+
+#endif /* PAM_RUNDIR_BENCH_H */
@@ -0,0 +1,113 @@
+/*
+ * pam_rundir - Copyright (C) 2015 Olivier Brunel
+ *
+ * test/bench_nss.c
+ * Preloaded by the benchmark: serves users BENCH_USER_PREFIX<N> without them
+ * existing, and delays every user lookup by BENCH_DELAY_ENV microseconds, to
+ * mimic a slow NSS backend (e.g. LDAP).
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see http://www.gnu.org/licenses/
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <dlfcn.h>
+#include <pwd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+static void
+delay(void)
+{
+    const char *s = getenv(BENCH_DELAY_ENV);
+    struct timespec ts;
+    long us;
+
+    if (s == NULL || (us = atol(s)) <= 0)
+        return;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/* Fill pw for name, using buf (len) for strings.
+ * Returns 1 if it is one of ours, 0 if not, -1 if buf is too small. */
+static int
+fake_user(const char *name, struct passwd *pw, char *buf, size_t len)
+{
+    const size_t l = sizeof(BENCH_USER_PREFIX) - 1;
+    char *end;
+    long n;
+    int r;
+
+    if (strncmp(name, BENCH_USER_PREFIX, l) != 0 || name[l] < '0' || name[l] > '9')
+        return 0;
+    n = strtol(name + l, &end, 10);
+    if (*end != '\0' || n < 0 || n > 1000000)
+        return 0;
+
+    r = snprintf(buf, len, "%s%cx%c/%c/bin/false", name, '\0', '\0', '\0');
+    if (r < 0 || (size_t) r >= len)
+        return -1;
+    pw->pw_name = buf;
+    pw->pw_passwd = buf + strlen(name) + 1;
+    pw->pw_dir = pw->pw_passwd + 2;
+    pw->pw_shell = pw->pw_dir + 2;
+    pw->pw_gecos = pw->pw_shell + strlen(pw->pw_shell);
+    pw->pw_uid = BENCH_UID_BASE + n;
+    pw->pw_gid = BENCH_UID_BASE + n;
+    return 1;
+}
+
+struct passwd *
+getpwnam(const char *name)
+{
+    static struct passwd *(*real)(const char *);
+    static struct passwd pw;
+    static char buf[128];
+
+    delay();
+    if (fake_user(name, &pw, buf, sizeof(buf)) > 0)
+        return &pw;
+
+    if (real == NULL)
+        real = (struct passwd *(*)(const char *)) dlsym(RTLD_NEXT, "getpwnam");
+    return real(name);
+}
+
+int
+getpwnam_r(const char *name, struct passwd *pw, char *buf, size_t len,
+           struct passwd **result)
+{
+    static int (*real)(const char *, struct passwd *, char *, size_t, struct passwd **);
+    int r;
+
+    delay();
+    r = fake_user(name, pw, buf, len);
+    if (r != 0) {
+        *result = (r > 0) ? pw : NULL;
+        return (r > 0) ? 0 : ERANGE;
+    }
+
+    if (real == NULL)
+        real = (int (*)(const char *, struct passwd *, char *, size_t, struct passwd **))
+            dlsym(RTLD_NEXT, "getpwnam_r");
+    return real(name, pw, buf, len, result);
+}
@@ -0,0 +1,575 @@
+/*
+ * pam_rundir - Copyright (C) 2015 Olivier Brunel
+ *
+ * test/replay.c
+ * Replay of a trace ring (trace= option) through librundir, against a scratch
+ * parent dir.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see http://www.gnu.org/licenses/
+ */
+
+/*
+ * Usage: replay [OPTION]... TRACE
+ *
+ * Re-drives the sessions recorded in TRACE (e.g. /run/users/.trace): every
+ * open and close is started at the same time relative to the first one, by a
+ * pool of WORKERS threads, then one line per operation is printed with its
+ * latency percentiles, as the benchmark does:
+ *
+ *   replay op=open count=4000 errors=0 p50_us=41 p99_us=180 ...
+ *
+ * Sessions are opened for the recorded uid/gid, no user lookup is involved.
+ * Failed opens are not replayed, nor closes of sessions opened before the
+ * oldest record; sessions still open at the end are closed then.
+ *
+ * Options:
+ *   -d           print the records, don't replay
+ *   -w WORKERS   threads doing operations [highest concurrency in TRACE]
+ *   -s SPEED     time scale, e.g. 2 goes twice as fast, 0 as fast as possible [1]
+ *   -o OPTIONS   librundir options, after dir= (e.g. "counters=table")
+ *
+ * Must be run as root. Everything happens in a temporary directory (dir= of
+ * librundir), removed afterwards.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <ftw.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "rundir.h"
+#include "trace.h"
+
+#define NOT_RUN INT64_MIN
+#define MAX_OPTIONS 64
+
+/* A session, as replayed */
+struct session {
+    uint64_t id;
+    uid_t uid;
+    gid_t gid;
+    struct rundir_session *s;      /* Once opened, NULL if that failed */
+    int opened;                    /* Open was done (successfully or not) */
+    int closed;
+};
+
+/* An operation to replay */
+struct event {
+    int64_t time_ns;               /* Relative to the first one */
+    int64_t duration_ns;           /* As recorded */
+    int op;
+    struct session *session;
+    int64_t latency;               /* Replayed, negative on error */
+    int64_t lag;                   /* How late it was started */
+};
+
+struct replay {
+    const struct rundir *rd;
+    struct event *events;
+    long n;
+    double speed;
+    int64_t start;                 /* Of the replay, CLOCK_MONOTONIC */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;           /* Events released, or sessions opened */
+    long released;                 /* Events workers may take */
+    long next;                     /* Next event to take */
+};
+
+static const char *phase_names[TRACE_PHASES] = TRACE_PHASE_NAMES;
+
+static int64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Records by time, opens before closes at the same time */
+static int
+cmp_record(const void *a, const void *b)
+{
+    const struct trace_record *x = a, *y = b;
+
+    if (x->time_ns != y->time_ns)
+        return (x->time_ns > y->time_ns) - (x->time_ns < y->time_ns);
+    return (int) x->op - (int) y->op;
+}
+
+static int
+cmp_session(const void *a, const void *b)
+{
+    const struct session *x = a, *y = b;
+
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+static int
+remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)ftw;
+    return (type == FTW_DP) ? rmdir(path) : unlink(path);
+}
+
+/* Load the complete records of the trace ring file into *records, oldest
+ * first. Returns their number, or -1 on error. */
+static long
+load(const char *file, struct trace_record **records)
+{
+    const struct trace_header *hdr;
+    const struct trace_record *ring;
+    struct stat st;
+    uint32_t i;
+    long n = 0;
+    int fd;
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "replay: %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    if ((size_t) st.st_size < sizeof(*hdr)) {
+        fprintf(stderr, "replay: %s: not a trace\n", file);
+        return -1;
+    }
+    hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        fprintf(stderr, "replay: %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    if (hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION
+            || hdr->record_size != sizeof(struct trace_record)
+            || sizeof(*hdr) + (size_t) hdr->records * sizeof(*ring) > (size_t) st.st_size) {
+        fprintf(stderr, "replay: %s: not a trace, or unsupported version\n", file);
+        return -1;
+    }
+
+    *records = malloc((hdr->records ? hdr->records : 1) * sizeof(**records));
+    if (*records == NULL) {
+        perror("replay: malloc");
+        return -1;
+    }
+
+    /* Skip records being written, or overwritten while copied */
+    ring = (const struct trace_record *) (hdr + 1);
+    for (i = 0; i < hdr->records; ++i) {
+        uint64_t seq = __atomic_load_n(&ring[i].seq, __ATOMIC_ACQUIRE);
+
+        if (seq == 0 || (seq - 1) % hdr->records != i)
+            continue;
+        (*records)[n] = ring[i];
+        if (__atomic_load_n(&ring[i].seq, __ATOMIC_ACQUIRE) == seq)
+            ++n;
+    }
+    munmap((void *) hdr, st.st_size);
+
+    qsort(*records, n, sizeof(**records), cmp_record);
+    return n;
+}
+
+static void
+dump(const struct trace_record *records, long n)
+{
+    long i;
+    int p;
+
+    for (i = 0; i < n; ++i) {
+        const struct trace_record *r = &records[i];
+
+        printf("trace time_ns=%lld session=%llx uid=%u gid=%u pid=%u op=%s result=%d total_us=%u",
+               (long long) r->time_ns, (unsigned long long) r->session, r->uid, r->gid,
+               r->pid, (r->op == TRACE_OPEN) ? "open" : "close", r->result, r->total_us);
+        for (p = 0; p < TRACE_PHASES; ++p)
+            printf(" %s_us=%u", phase_names[p], r->us[p]);
+        printf(" entries=%u\n", r->entries);
+    }
+}
+
+/* Turn the records into the events to replay, and their sessions. Returns the
+ * number of events, or -1 on error. */
+static long
+prepare(const struct trace_record *records, long n, struct event **events,
+        struct session **sessions, long *skipped)
+{
+    struct session *ss;
+    struct event *ev;
+    long ns = 0;
+    long ne = 0;
+    long i;
+
+    ss = malloc((n ? n : 1) * sizeof(*ss));
+    ev = malloc((n ? n : 1) * sizeof(*ev));
+    if (ss == NULL || ev == NULL) {
+        perror("replay: malloc");
+        return -1;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (records[i].op == TRACE_OPEN && records[i].result == RUNDIR_OK
+                && records[i].session != 0) {
+            memset(&ss[ns], 0, sizeof(*ss));
+            ss[ns].id = records[i].session;
+            ss[ns].uid = records[i].uid;
+            ss[ns].gid = records[i].gid;
+            ++ns;
+        }
+    }
+    qsort(ss, ns, sizeof(*ss), cmp_session);
+
+    *skipped = 0;
+    for (i = 0; i < n; ++i) {
+        const struct trace_record *r = &records[i];
+        struct session key = { .id = r->session };
+        struct session *s = NULL;
+
+        if (r->session != 0)
+            s = bsearch(&key, ss, ns, sizeof(*ss), cmp_session);
+        if (s == NULL || (r->op == TRACE_OPEN && r->result != RUNDIR_OK)
+                || (r->op == TRACE_CLOSE && !s->opened)) {
+            ++*skipped;
+            continue;
+        }
+        /* Used as "seen" until replaying */
+        if (r->op == TRACE_OPEN)
+            s->opened = 1;
+        if (r->op == TRACE_CLOSE && s->closed++) {
+            ++*skipped;
+            continue;
+        }
+
+        ev[ne].time_ns = r->time_ns - records[0].time_ns;
+        ev[ne].duration_ns = (int64_t) r->total_us * 1000;
+        ev[ne].op = r->op;
+        ev[ne].session = s;
+        ev[ne].latency = NOT_RUN;
+        ev[ne].lag = 0;
+        ++ne;
+    }
+    for (i = 0; i < ns; ++i)
+        ss[i].opened = ss[i].closed = 0;
+
+    *events = ev;
+    *sessions = ss;
+    return ne;
+}
+
+/* Highest number of operations recorded as running at once */
+static long
+concurrency(const struct event *ev, long n)
+{
+    int64_t *ends = malloc((n ? n : 1) * sizeof(*ends));
+    long running = 0;
+    long most = 1;
+    long i, j;
+
+    if (ends == NULL)
+        return 1;
+    for (i = 0; i < n; ++i)
+        ends[i] = ev[i].time_ns + ev[i].duration_ns;
+    qsort(ends, n, sizeof(*ends), cmp_int64);
+
+    /* Events are sorted by start */
+    for (i = 0, j = 0; i < n; ++i) {
+        ++running;
+        while (j < n && ends[j] <= ev[i].time_ns) {
+            --running;
+            ++j;
+        }
+        if (running > most)
+            most = running;
+    }
+    free(ends);
+    return most;
+}
+
+static void
+run_event(struct replay *rp, struct event *ev)
+{
+    struct session *s = ev->session;
+    int64_t start;
+    int r;
+
+    if (ev->op == TRACE_OPEN) {
+        struct rundir_session *rs = NULL;
+
+        start = now_ns();
+        r = rundir_acquire(rp->rd, s->uid, s->gid, &rs);
+        ev->latency = (r == RUNDIR_OK) ? now_ns() - start : -1;
+
+        pthread_mutex_lock(&rp->lock);
+        s->s = (r == RUNDIR_OK) ? rs : NULL;
+        s->opened = 1;
+        pthread_cond_broadcast(&rp->cond);
+        pthread_mutex_unlock(&rp->lock);
+        return;
+    }
+
+    /* Its open was taken before, by another worker maybe */
+    pthread_mutex_lock(&rp->lock);
+    while (!s->opened)
+        pthread_cond_wait(&rp->cond, &rp->lock);
+    pthread_mutex_unlock(&rp->lock);
+    if (s->s == NULL)
+        return;
+
+    start = now_ns();
+    r = rundir_release(s->s);
+    ev->latency = (r == RUNDIR_OK) ? now_ns() - start : -1;
+    rundir_session_free(s->s);
+    s->s = NULL;
+    s->closed = 1;
+}
+
+static void *
+worker(void *arg)
+{
+    struct replay *rp = arg;
+
+    for (;;) {
+        struct event *ev;
+
+        pthread_mutex_lock(&rp->lock);
+        while (rp->next == rp->released && rp->released < rp->n)
+            pthread_cond_wait(&rp->cond, &rp->lock);
+        if (rp->next == rp->n) {
+            pthread_mutex_unlock(&rp->lock);
+            return NULL;
+        }
+        ev = &rp->events[rp->next++];
+        pthread_mutex_unlock(&rp->lock);
+
+        if (rp->speed > 0)
+            ev->lag = now_ns() - rp->start - (int64_t) (ev->time_ns / rp->speed);
+        run_event(rp, ev);
+    }
+}
+
+/* Release events to workers as their time comes */
+static void
+dispatch(struct replay *rp)
+{
+    long i;
+
+    rp->start = now_ns();
+    for (i = 0; i < rp->n; ++i) {
+        if (rp->speed > 0) {
+            int64_t t = rp->start + (int64_t) (rp->events[i].time_ns / rp->speed);
+            struct timespec ts = { t / 1000000000, t % 1000000000 };
+
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+        }
+        pthread_mutex_lock(&rp->lock);
+        rp->released = i + 1;
+        pthread_cond_broadcast(&rp->cond);
+        pthread_mutex_unlock(&rp->lock);
+    }
+}
+
+/* Sort the latencies of op among the n events and print their percentiles */
+static void
+report(const char *op, int type, const struct event *ev, long n, int64_t *lat)
+{
+    long errors = 0;
+    long count = 0;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        if (ev[i].op != type || ev[i].latency == NOT_RUN)
+            continue;
+        if (ev[i].latency >= 0)
+            lat[count++] = ev[i].latency;
+        else
+            ++errors;
+    }
+    qsort(lat, count, sizeof(*lat), cmp_int64);
+
+#define PCT(p) (count ? lat[(long) ((count - 1) * (p))] / 1000 : 0)
+    printf("replay op=%s count=%ld errors=%ld"
+           " p50_us=%lld p99_us=%lld p999_us=%lld max_us=%lld\n",
+           op, count, errors,
+           (long long) PCT(0.5), (long long) PCT(0.99), (long long) PCT(0.999),
+           (long long) PCT(1.0));
+#undef PCT
+}
+
+static void
+usage(int status)
+{
+    fprintf(status ? stderr : stdout,
+            "Usage: replay [-d] [-w WORKERS] [-s SPEED] [-o OPTIONS] TRACE\n");
+    exit(status);
+}
+
+static long
+parse_long(const char *s)
+{
+    char *end;
+    long v;
+
+    errno = 0;
+    v = strtol(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || v <= 0)
+        usage(1);
+    return v;
+}
+
+int
+main(int argc, char **argv)
+{
+    char tmpdir[] = "/tmp/pam_rundir_replay.XXXXXX";
+    char dir[PATH_MAX];
+    const char *args[MAX_OPTIONS];
+    struct trace_record *records;
+    struct session *sessions;
+    struct replay rp;
+    struct rundir *rd;
+    pthread_t *tids;
+    char *options = NULL;
+    int64_t elapsed;
+    int64_t *lat;
+    long workers = 0;
+    long skipped;
+    long unclosed = 0;
+    long opens = 0;
+    long n, w, i;
+    int nargs = 0;
+    int dump_only = 0;
+    char *end;
+    char *arg;
+    int opt;
+
+    memset(&rp, 0, sizeof(rp));
+    rp.speed = 1;
+    while ((opt = getopt(argc, argv, "hdw:s:o:")) != -1) {
+        switch (opt) {
+            case 'd': dump_only = 1; break;
+            case 'w': workers = parse_long(optarg); break;
+            case 's':
+                errno = 0;
+                rp.speed = strtod(optarg, &end);
+                if (errno != 0 || end == optarg || *end != '\0' || rp.speed < 0)
+                    usage(1);
+                break;
+            case 'o': options = strdup(optarg); break;
+            case 'h': usage(0); break;
+            default: usage(1);
+        }
+    }
+    if (argc - optind != 1)
+        usage(1);
+
+    n = load(argv[optind], &records);
+    if (n < 0)
+        return 1;
+    if (dump_only) {
+        dump(records, n);
+        return 0;
+    }
+    if (geteuid() != 0) {
+        fprintf(stderr, "replay: must be run as root\n");
+        return 1;
+    }
+
+    rp.n = prepare(records, n, &rp.events, &sessions, &skipped);
+    if (rp.n < 0)
+        return 1;
+    if (workers == 0)
+        workers = concurrency(rp.events, rp.n);
+
+    /* librundir, with dir= inside our temporary directory */
+    if (mkdtemp(tmpdir) == NULL) {
+        perror("replay: mkdtemp");
+        return 1;
+    }
+    snprintf(dir, sizeof(dir), "dir=%s/run", tmpdir);
+    args[nargs++] = dir;
+    for (arg = options ? strtok(options, " ") : NULL; arg && nargs < MAX_OPTIONS;
+         arg = strtok(NULL, " "))
+        args[nargs++] = arg;
+    rd = rundir_new(nargs, args);
+    if (rd == NULL)
+        return 1;
+    rp.rd = rd;
+
+    tids = malloc(workers * sizeof(*tids));
+    lat = malloc((rp.n ? rp.n : 1) * sizeof(*lat));
+    if (tids == NULL || lat == NULL) {
+        perror("replay: malloc");
+        return 1;
+    }
+    pthread_mutex_init(&rp.lock, NULL);
+    pthread_cond_init(&rp.cond, NULL);
+    for (w = 0; w < workers; ++w) {
+        if (pthread_create(&tids[w], NULL, worker, &rp) != 0) {
+            perror("replay: pthread_create");
+            return 1;
+        }
+    }
+    dispatch(&rp);
+    for (w = 0; w < workers; ++w)
+        pthread_join(tids[w], NULL);
+    elapsed = now_ns() - rp.start;
+
+    /* Sessions whose close wasn't recorded (yet) */
+    for (i = 0; i < rp.n; ++i) {
+        struct session *s = rp.events[i].session;
+
+        if (rp.events[i].op == TRACE_OPEN && rp.events[i].latency >= 0)
+            ++opens;
+        if (rp.events[i].op == TRACE_OPEN && s->s != NULL) {
+            rundir_release(s->s);
+            rundir_session_free(s->s);
+            s->s = NULL;
+            ++unclosed;
+        }
+    }
+
+    for (i = 0; i < rp.n; ++i)
+        lat[i] = (rp.events[i].lag > 0) ? rp.events[i].lag : 0;
+    qsort(lat, rp.n, sizeof(*lat), cmp_int64);
+    printf("replay records=%ld events=%ld skipped=%ld workers=%ld speed=%g elapsed_ms=%lld"
+           " sessions_per_s=%.0f unclosed=%ld lag_p99_us=%lld\n",
+           n, rp.n, skipped, workers, rp.speed, (long long) (elapsed / 1000000),
+           (double) opens * 1e9 / (double) (elapsed ? elapsed : 1), unclosed,
+           (long long) (rp.n ? lat[(long) ((rp.n - 1) * 0.99)] / 1000 : 0));
+    report("open", TRACE_OPEN, rp.events, rp.n, lat);
+    report("close", TRACE_CLOSE, rp.events, rp.n, lat);
+
+    rundir_free(rd);
+    nftw(tmpdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+    return 0;
+}
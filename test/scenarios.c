@@ -0,0 +1,960 @@
+/*
+ * pam_rundir - Copyright (C) 2015 Olivier Brunel
+ *
+ * test/scenarios.c
+ * Behavior tests of the module's options, each a short scenario of sessions
+ * asserting the option's effect on PARENT_DIR.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see http://www.gnu.org/licenses/
+ */
+
+/*
+ * Usage: scenarios MODULE [SCENARIO]...
+ *
+ * Runs the given scenarios (all by default), opening and closing sessions of
+ * the users of bench_nss.so, which must be preloaded (see `make check`),
+ * through libpam with a private service file, as the benchmark does. Every
+ * scenario gets a fresh dir= and its own options, then checks what they're
+ * meant to do, printing one line per scenario, and per failed check. The gc and
+ * status scenarios run rundir-gc and rundir-status from the directory of MODULE,
+ * and that rundir-gc is the reaper= of all of them.
+ *
+ *   scenarios registry FAIL: directory of uid 200000 still there, dead session not pruned
+ *   scenarios registry failed=1
+ *   scenarios gc ok
+ *   scenarios total=2 failed=1
+ *
+ * Must be run as root; everything happens in a temporary directory, removed
+ * afterwards. Exits with 1 if any check failed.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <security/pam_appl.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bench.h"
+
+#define SERVICE "rundir-scenarios"
+#define ENVVAR "RUNDIR_SCENARIO_DIR"
+
+/* Counter records, see pam_rundir(8) */
+#define COUNTER_MAGIC 0x43445252
+
+struct counter_record {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t count;
+    uint32_t check;                /* FNV-1a of the fields above */
+};
+
+/* Usage records, see pam_rundir(8) */
+#define USAGE_MAGIC 0x53554452
+
+struct usage_record {
+    uint32_t key;                  /* uid + 1 */
+    uint32_t teardowns;
+    uint64_t entries;              /* Of the largest teardown */
+    uint64_t bytes;
+    uint32_t us;
+    uint32_t max_us;
+    uint64_t total_bytes;
+    int64_t last;
+};
+
+struct ctx {
+    char confdir[64];              /* Service file, and dir= of every scenario */
+    char dir[128];                 /* dir= of the current scenario */
+    const char *module;
+    char bindir[PATH_MAX];         /* Directory of the module, and its tools */
+    const char *name;              /* Current scenario */
+    long failed;                   /* Checks failed in the current scenario */
+};
+
+static struct ctx ctx;
+
+static int
+conv(int n, const struct pam_message **msg, struct pam_response **resp, void *data)
+{
+    (void)n;
+    (void)msg;
+    (void)resp;
+    (void)data;
+    return PAM_CONV_ERR;
+}
+
+static int
+remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)ftw;
+    return (type == FTW_DP) ? rmdir(path) : unlink(path);
+}
+
+/* Report a failed check, unless cond. Returns cond. */
+__attribute__((format(printf, 2, 3)))
+static int
+expect(int cond, const char *format, ...)
+{
+    va_list ap;
+
+    if (cond)
+        return 1;
+    printf("scenarios %s FAIL: ", ctx.name);
+    va_start(ap, format);
+    vprintf(format, ap);
+    va_end(ap);
+    putchar('\n');
+    ++ctx.failed;
+    return 0;
+}
+
+/* Start scenario name: a fresh dir=, and the service file with options */
+static int
+setup(const char *name, const char *options)
+{
+    char path[PATH_MAX + 64];
+    FILE *f;
+
+    ctx.name = name;
+    ctx.failed = 0;
+    snprintf(ctx.dir, sizeof(ctx.dir), "%s/%s", ctx.confdir, name);
+    snprintf(path, sizeof(path), "%s/%s", ctx.confdir, SERVICE);
+    f = fopen(path, "w");
+    if (f == NULL) {
+        expect(0, "can't write %s: %s", path, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "session required %s dir=%s envvar=%s reaper=%s/rundir-gc %s\n", ctx.module,
+            ctx.dir, ENVVAR, ctx.bindir, options);
+    fclose(f);
+    return 0;
+}
+
+/* Open a session of user u, on tty unless NULL. Returns its handle, or NULL */
+static pam_handle_t *
+open_session(long u, const char *tty)
+{
+    struct pam_conv c = { conv, NULL };
+    char user[64];
+    pam_handle_t *h;
+
+    snprintf(user, sizeof(user), "%s%ld", BENCH_USER_PREFIX, u);
+    if (pam_start_confdir(SERVICE, user, &c, ctx.confdir, &h) != PAM_SUCCESS)
+        return NULL;
+    if ((tty && pam_set_item(h, PAM_TTY, tty) != PAM_SUCCESS)
+            || pam_open_session(h, 0) != PAM_SUCCESS) {
+        pam_end(h, PAM_SESSION_ERR);
+        return NULL;
+    }
+    return h;
+}
+
+/* Close the session of h, if any. Returns 0 on success. */
+static int
+close_session(pam_handle_t *h)
+{
+    int r;
+
+    if (h == NULL)
+        return -1;
+    r = pam_close_session(h, 0);
+    pam_end(h, r);
+    return (r == PAM_SUCCESS) ? 0 : -1;
+}
+
+/* Open then close a session of user u. Returns 0 on success. */
+static int
+session(long u)
+{
+    return close_session(open_session(u, NULL));
+}
+
+/* Path of the runtime directory of user u into buf (PATH_MAX) */
+static const char *
+dir_of(char *buf, long u)
+{
+    snprintf(buf, PATH_MAX, "%s/%ld", ctx.dir, BENCH_UID_BASE + u);
+    return buf;
+}
+
+/* Inode of the directory of user u, or 0 if there isn't one */
+static ino_t
+dir_ino(long u)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (lstat(dir_of(path, u), &st) < 0 || !S_ISDIR(st.st_mode))
+        return 0;
+    return st.st_ino;
+}
+
+/* Entries of the pool, their inodes into inos (up to max of them) */
+static int
+pool_entries(ino_t *inos, int max)
+{
+    char path[PATH_MAX];
+    struct dirent *d;
+    DIR *dir;
+    int n = 0;
+
+    snprintf(path, sizeof(path), "%s/.pool", ctx.dir);
+    dir = opendir(path);
+    if (dir == NULL)
+        return 0;
+    while ((d = readdir(dir)) != NULL) {
+        if (d->d_name[0] == '.')
+            continue;
+        if (n < max)
+            inos[n] = d->d_ino;
+        ++n;
+    }
+    closedir(dir);
+    return n;
+}
+
+/* Wait up to 5 seconds for the pool to hold n entries. Returns how many it does. */
+static int
+wait_pool(int n, ino_t *inos, int max)
+{
+    struct timespec ts = { 0, 10000000 };
+    int i, m = 0;
+
+    for (i = 0; i < 500 && (m = pool_entries(inos, max)) != n; ++i)
+        nanosleep(&ts, NULL);
+    return m;
+}
+
+/* Create file name in directory dir, of size bytes */
+static int
+write_file(const char *dir, const char *name, size_t size)
+{
+    char path[PATH_MAX + 64];
+    char buf[4096];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "w");
+    if (f == NULL)
+        return -1;
+    memset(buf, 'x', sizeof(buf));
+    while (size > 0) {
+        size_t l = (size < sizeof(buf)) ? size : sizeof(buf);
+
+        if (fwrite(buf, 1, l, f) != l)
+            break;
+        size -= l;
+    }
+    return (fclose(f) == 0 && size == 0) ? 0 : -1;
+}
+
+/* linger=: the directory survives the last logout, and is handed back as is
+ * within the window; past it, the next session (of anyone) removes it */
+static void
+scenario_linger(void)
+{
+    char path[PATH_MAX];
+    ino_t ino;
+
+    if (setup("linger", "linger=1") < 0)
+        return;
+    if (!expect(session(0) == 0, "session of uid %d failed", BENCH_UID_BASE))
+        return;
+    ino = dir_ino(0);
+    expect(ino != 0, "directory of uid %d gone after logout", BENCH_UID_BASE);
+    expect(write_file(dir_of(path, 0), "kept", 1) == 0, "can't write in %s", path);
+
+    expect(session(0) == 0, "session of uid %d failed", BENCH_UID_BASE);
+    expect(dir_ino(0) == ino, "directory of uid %d recreated within linger=", BENCH_UID_BASE);
+    strcat(path, "/kept");
+    expect(access(path, F_OK) == 0, "%s gone within linger=", path);
+
+    sleep(2);
+    expect(session(1) == 0, "session of uid %d failed", BENCH_UID_BASE + 1);
+    expect(dir_ino(0) == 0, "directory of uid %d still there after expiry", BENCH_UID_BASE);
+}
+
+/* registry: the session of a process killed while holding it is dropped by the
+ * user's next session, so the directory goes with the last logout */
+static void
+scenario_registry(void)
+{
+    pam_handle_t *h;
+    pid_t pid;
+    int status;
+
+    if (setup("registry", "registry") < 0)
+        return;
+    pid = fork();
+    if (pid < 0) {
+        expect(0, "fork failed: %s", strerror(errno));
+        return;
+    } else if (pid == 0) {
+        if (open_session(0, NULL) == NULL)
+            _exit(1);
+        raise(SIGKILL);
+    }
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    if (!expect(WIFSIGNALED(status), "session of uid %d failed in the child", BENCH_UID_BASE))
+        return;
+    expect(dir_ino(0) != 0, "directory of uid %d missing after the child died", BENCH_UID_BASE);
+
+    h = open_session(0, NULL);
+    expect(h != NULL, "session of uid %d failed", BENCH_UID_BASE);
+    expect(close_session(h) == 0, "closing session of uid %d failed", BENCH_UID_BASE);
+    expect(dir_ino(0) == 0, "directory of uid %d still there, dead session not pruned",
+           BENCH_UID_BASE);
+}
+
+/* Run rundir-gc with args against the scenario's dir=, its summary line into
+ * line. Returns its exit status, or -1 if it didn't run. */
+static int
+run_gc(const char *args, char *line, size_t size)
+{
+    char cmd[PATH_MAX * 2 + 64];
+    char buf[512];
+    FILE *f;
+    int r;
+
+    snprintf(cmd, sizeof(cmd), "%s/rundir-gc %s dir=%s", ctx.bindir, args, ctx.dir);
+    f = popen(cmd, "r");
+    if (f == NULL)
+        return -1;
+    line[0] = '\0';
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        buf[strcspn(buf, "\n")] = '\0';
+        if (strncmp(buf, "rundir-gc ", 10) == 0)
+            snprintf(line, size, "%s", buf + 10);
+    }
+    r = pclose(f);
+    return (r < 0 || !WIFEXITED(r)) ? -1 : WEXITSTATUS(r);
+}
+
+/* Create the directory of user u behind the module's back, owned by u */
+static int
+make_dir(long u)
+{
+    char path[PATH_MAX];
+
+    return (mkdir(dir_of(path, u), 0700) == 0
+            && chown(path, BENCH_UID_BASE + u, BENCH_UID_BASE + u) == 0) ? 0 : -1;
+}
+
+/* rundir-gc: a dry run touches nothing; then directories without a counter,
+ * or whose counter is at 0, are removed, while the one of a session is kept */
+static void
+scenario_gc(void)
+{
+    char line[512];
+    pam_handle_t *h;
+
+    if (setup("gc", "") < 0)
+        return;
+    h = open_session(0, NULL);
+    if (!expect(h != NULL, "session of uid %d failed", BENCH_UID_BASE))
+        return;
+    /* Left behind: one with its counter at 0, one without a counter */
+    expect(session(1) == 0, "session of uid %d failed", BENCH_UID_BASE + 1);
+    expect(make_dir(1) == 0 && make_dir(2) == 0, "can't create directories in %s", ctx.dir);
+
+    expect(run_gc("-n", line, sizeof(line)) == 0, "rundir-gc -n failed: %s", line);
+    expect(strstr(line, " orphans=1 ") && strstr(line, " unused=1 ")
+           && strstr(line, " removed=0 "), "rundir-gc -n reported %s", line);
+    expect(dir_ino(1) != 0 && dir_ino(2) != 0, "rundir-gc -n removed directories");
+
+    expect(run_gc("", line, sizeof(line)) == 0, "rundir-gc failed: %s", line);
+    expect(strstr(line, " removed=2 ") != NULL, "rundir-gc reported %s", line);
+    expect(dir_ino(1) == 0, "directory of uid %d with its counter at 0 still there",
+           BENCH_UID_BASE + 1);
+    expect(dir_ino(2) == 0, "directory of uid %d without a counter still there",
+           BENCH_UID_BASE + 2);
+    expect(dir_ino(0) != 0, "directory of uid %d removed while in use", BENCH_UID_BASE);
+
+    expect(close_session(h) == 0, "closing session of uid %d failed", BENCH_UID_BASE);
+    expect(dir_ino(0) == 0, "directory of uid %d still there", BENCH_UID_BASE);
+}
+
+/* FNV-1a of len bytes of data, the checksum of counter records */
+static uint32_t
+fnv1a(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint32_t h = 2166136261u;
+
+    while (len-- > 0) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Read the counter file of user u into buf (of size bytes). Returns how many
+ * bytes it holds, or -1 */
+static ssize_t
+read_counter(long u, void *buf, size_t size)
+{
+    char path[PATH_MAX];
+    ssize_t r;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/.%ld", ctx.dir, BENCH_UID_BASE + u);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    r = read(fd, buf, size);
+    close(fd);
+    return r;
+}
+
+/* Write size bytes of buf as the counter file of user u. Returns 0 on success */
+static int
+write_counter(long u, const void *buf, size_t size)
+{
+    char path[PATH_MAX];
+    FILE *f;
+    int r;
+
+    snprintf(path, sizeof(path), "%s/.%ld", ctx.dir, BENCH_UID_BASE + u);
+    f = fopen(path, "w");
+    if (f == NULL)
+        return -1;
+    r = (fwrite(buf, 1, size, f) == size) ? 0 : -1;
+    return (fclose(f) == 0) ? r : -1;
+}
+
+/* Counters in the older ASCII format carry over, and are rewritten as records
+ * by the next session; a record failing its checksum is rejected */
+static void
+scenario_migration(void)
+{
+    struct counter_record rec, bad;
+    ssize_t r;
+
+    if (setup("migration", "") < 0)
+        return;
+    if (!expect((mkdir(ctx.dir, 0755) == 0 || errno == EEXIST) && make_dir(0) == 0
+                && write_counter(0, "2", 1) == 0, "can't create ASCII counter in %s", ctx.dir))
+        return;
+
+    expect(session(0) == 0, "session of uid %d failed", BENCH_UID_BASE);
+    expect(dir_ino(0) != 0, "directory of uid %d removed, ASCII counter of 2 not carried over",
+           BENCH_UID_BASE);
+    r = read_counter(0, &rec, sizeof(rec));
+    if (!expect(r == sizeof(rec) && rec.magic == COUNTER_MAGIC, "counter of uid %d not "
+                "rewritten as a record (%zd bytes)", BENCH_UID_BASE, r))
+        return;
+    expect(rec.count == 2 && rec.flags == 0, "counter of uid %d is %u (flags %#x), not 2",
+           BENCH_UID_BASE, rec.count, rec.flags);
+    expect(rec.check == fnv1a(&rec, offsetof(struct counter_record, check)),
+           "counter record of uid %d has a bad checksum", BENCH_UID_BASE);
+
+    /* Torn or garbage: the session fails, and the record is left as is */
+    bad = rec;
+    bad.check ^= 1;
+    if (!expect(write_counter(0, &bad, sizeof(bad)) == 0, "can't corrupt counter of uid %d",
+                BENCH_UID_BASE))
+        return;
+    expect(session(0) < 0, "session of uid %d succeeded with a bad checksum", BENCH_UID_BASE);
+    r = read_counter(0, &rec, sizeof(rec));
+    expect(r == sizeof(rec) && memcmp(&rec, &bad, sizeof(rec)) == 0,
+           "counter record of uid %d with a bad checksum was rewritten", BENCH_UID_BASE);
+    expect(dir_ino(0) != 0, "directory of uid %d removed with a bad checksum", BENCH_UID_BASE);
+}
+
+/* Open a session of user u on tty, and check whether it got a directory and
+ * envvar=, as expected, while open */
+static void
+expect_handled(long u, const char *tty, int handled)
+{
+    pam_handle_t *h = open_session(u, tty);
+    const char *var;
+
+    if (!expect(h != NULL, "session of uid %ld on %s failed", BENCH_UID_BASE + u, tty))
+        return;
+    var = pam_getenv(h, ENVVAR);
+    expect((dir_ino(u) != 0) == handled, "session of uid %ld on %s %s a directory",
+           BENCH_UID_BASE + u, tty, handled ? "didn't get" : "got");
+    expect((var != NULL) == handled, "session of uid %ld on %s %s " ENVVAR,
+           BENCH_UID_BASE + u, tty, handled ? "didn't get" : "got");
+    expect(close_session(h) == 0, "closing session of uid %ld failed", BENCH_UID_BASE + u);
+}
+
+/* include=/exclude=: only sessions included and not excluded get a directory
+ * (and envvar=), the others succeed without one */
+static void
+scenario_include(void)
+{
+    if (setup("include", "include=user:" BENCH_USER_PREFIX "0," BENCH_USER_PREFIX "1"
+              " exclude=tty:cron,ssh*") < 0)
+        return;
+    expect_handled(0, "pts/0", 1);
+    expect_handled(1, "tty1", 1);
+    expect_handled(0, "cron", 0);
+    expect_handled(1, "sshd", 0);
+    expect_handled(2, "pts/0", 0);
+
+    if (setup("include", "exclude=service:rundir-scen*") < 0)
+        return;
+    expect_handled(0, "pts/0", 0);
+}
+
+/* Whether path is the extra directory of the first user, as created */
+static int
+extra_ready(const char *path)
+{
+    struct stat st;
+
+    return lstat(path, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == (uid_t) BENCH_UID_BASE
+        && (st.st_mode & 07777) == 0750;
+}
+
+/* extra_dir=: an extra directory comes and goes with the runtime directory, of
+ * its own mode, in its own variable. One removed while sessions are open is
+ * recreated by the next one, even joining through the table */
+static void
+scenario_extra_dir(void)
+{
+    static const char *const extra[] = { "", " counters=table" };
+    char path[PATH_MAX], options[64];
+    pam_handle_t *h[3];
+    const char *var;
+    size_t i;
+    int n;
+
+    for (i = 0; i < sizeof(extra) / sizeof(*extra); ++i) {
+        snprintf(options, sizeof(options), "extra_dir=%%u-scratch:SCRATCH_DIR:0750%s", extra[i]);
+        if (setup("extra_dir", options) < 0)
+            return;
+        h[0] = open_session(0, NULL);
+        if (!expect(h[0] != NULL, "session of uid %d failed (%s)", BENCH_UID_BASE, options))
+            return;
+        snprintf(path, sizeof(path), "%s/%d-scratch", ctx.dir, BENCH_UID_BASE);
+        expect(extra_ready(path), "%s not created, of uid %d and mode 0750 (%s)", path,
+               BENCH_UID_BASE, options);
+        var = pam_getenv(h[0], "SCRATCH_DIR");
+        expect(var && strcmp(var, path) == 0, "SCRATCH_DIR is %s, not %s (%s)",
+               var ? var : "unset", path, options);
+
+        h[1] = open_session(0, NULL);
+        expect(h[1] != NULL, "session of uid %d failed (%s)", BENCH_UID_BASE, options);
+
+        /* Removed meanwhile: the next session recreates it */
+        rmdir(path);
+        h[2] = open_session(0, NULL);
+        expect(h[2] != NULL, "session of uid %d failed (%s)", BENCH_UID_BASE, options);
+        expect(extra_ready(path), "%s not recreated, of uid %d and mode 0750 (%s)", path,
+               BENCH_UID_BASE, options);
+        var = h[2] ? pam_getenv(h[2], "SCRATCH_DIR") : NULL;
+        expect(var && strcmp(var, path) == 0, "SCRATCH_DIR is %s, not %s (%s)",
+               var ? var : "unset", path, options);
+
+        for (n = 2; n > 0; --n) {
+            if (h[n])
+                expect(close_session(h[n]) == 0, "closing session of uid %d failed (%s)",
+                       BENCH_UID_BASE, options);
+        }
+        expect(access(path, F_OK) == 0, "%s removed before the last logout (%s)", path,
+               options);
+        expect(close_session(h[0]) == 0, "closing session of uid %d failed (%s)",
+               BENCH_UID_BASE, options);
+        expect(access(path, F_OK) < 0, "%s still there after the last logout (%s)", path,
+               options);
+        expect(dir_ino(0) == 0, "directory of uid %d still there (%s)", BENCH_UID_BASE, options);
+    }
+}
+
+/* pool=: a first session that found the pool empty has it filled, the next
+ * ones take their directory from it, and it is refilled once down to half */
+static void
+scenario_pool(void)
+{
+    char path[PATH_MAX];
+    ino_t inos[4], ino;
+    pam_handle_t *h;
+    struct stat st;
+    int n, i;
+
+    if (setup("pool", "pool=4") < 0)
+        return;
+    expect(session(0) == 0, "session of uid %d failed", BENCH_UID_BASE);
+    n = wait_pool(4, inos, 4);
+    if (!expect(n == 4, "pool holds %d entries instead of 4", n))
+        return;
+
+    h = open_session(1, NULL);
+    expect(h != NULL, "session of uid %d failed", BENCH_UID_BASE + 1);
+    ino = dir_ino(1);
+    for (i = 0; i < 4 && inos[i] != ino; ++i)
+        ;
+    expect(i < 4, "directory of uid %d not taken from the pool", BENCH_UID_BASE + 1);
+    expect(lstat(dir_of(path, 1), &st) == 0 && st.st_uid == (uid_t) BENCH_UID_BASE + 1
+           && (st.st_mode & 07777) == 0700, "directory of uid %d not handed over",
+           BENCH_UID_BASE + 1);
+    n = pool_entries(inos, 4);
+    expect(n == 3, "pool holds %d entries instead of 3 after a take", n);
+
+    /* Down to half */
+    expect(session(2) == 0, "session of uid %d failed", BENCH_UID_BASE + 2);
+    n = wait_pool(4, inos, 4);
+    expect(n == 4, "pool holds %d entries instead of 4 after refill", n);
+    expect(close_session(h) == 0, "closing session of uid %d failed", BENCH_UID_BASE + 1);
+}
+
+/* Whether file a/b of the skeleton is in the directory of user u, owned by u */
+static int
+has_skel(long u)
+{
+    char path[PATH_MAX + 8];
+    struct stat st;
+
+    dir_of(path, u);
+    strcat(path, "/a/b");
+    return lstat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 3
+        && st.st_uid == (uid_t) BENCH_UID_BASE + u;
+}
+
+/* skel=: the skeleton is only copied into directories of first sessions, not
+ * into one fixed up while sessions are open, with or without pool= */
+static void
+scenario_skel(void)
+{
+    static const char *const extra[] = { "", " pool=2" };
+    char skel[PATH_MAX], path[PATH_MAX + 8];
+    char options[PATH_MAX + 32];
+    pam_handle_t *h[3];
+    struct stat st;
+    size_t i;
+
+    snprintf(skel, sizeof(skel), "%s/skeleton", ctx.confdir);
+    snprintf(path, sizeof(path), "%s/a", skel);
+    if (!expect((mkdir(skel, 0755) == 0 || errno == EEXIST) && (mkdir(path, 0750) == 0
+                || errno == EEXIST) && write_file(path, "b", 3) == 0,
+                "can't create skeleton in %s", skel))
+        return;
+    snprintf(path, sizeof(path), "%s/link", skel);
+    if (!expect(symlink("a/b", path) == 0 || errno == EEXIST, "can't create %s", path))
+        return;
+
+    for (i = 0; i < sizeof(extra) / sizeof(*extra); ++i) {
+        snprintf(options, sizeof(options), "skel=%s%s", skel, extra[i]);
+        if (setup("skel", options) < 0)
+            return;
+
+        h[0] = open_session(0, NULL);
+        expect(h[0] != NULL, "session of uid %d failed", BENCH_UID_BASE);
+        expect(has_skel(0), "skeleton missing from new directory (%s)", options);
+        dir_of(path, 0);
+        strcat(path, "/link");
+        expect(lstat(path, &st) == 0 && S_ISLNK(st.st_mode), "%s isn't a symlink", path);
+
+        /* Joining: nothing copied */
+        dir_of(path, 0);
+        strcat(path, "/a/b");
+        unlink(path);
+        h[1] = open_session(0, NULL);
+        expect(h[1] != NULL, "session of uid %d failed", BENCH_UID_BASE);
+        expect(!has_skel(0), "skeleton copied for a second session (%s)", options);
+
+        /* Fixed up while sessions are open: nothing copied either */
+        nftw(dir_of(path, 0), remove_entry, 16, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+        h[2] = open_session(0, NULL);
+        expect(h[2] != NULL, "session of uid %d failed", BENCH_UID_BASE);
+        expect(dir_ino(0) != 0, "directory of uid %d not recreated", BENCH_UID_BASE);
+        expect(!has_skel(0), "skeleton copied into a directory fixed up (%s)", options);
+
+        close_session(h[2]);
+        close_session(h[1]);
+        close_session(h[0]);
+        expect(dir_ino(0) == 0, "directory of uid %d still there", BENCH_UID_BASE);
+    }
+}
+
+/* Read the usage record of user u into rec. Returns 0, or -1 if there's none */
+static int
+read_usage(long u, struct usage_record *rec)
+{
+    char path[PATH_MAX];
+    uint32_t hdr[8];
+    uint32_t i;
+    FILE *f;
+    int r = -1;
+
+    snprintf(path, sizeof(path), "%s/.usage", ctx.dir);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    if (fread(hdr, sizeof(hdr), 1, f) == 1 && hdr[0] == USAGE_MAGIC && hdr[3] == sizeof(*rec)) {
+        for (i = 0; i < hdr[2] && fread(rec, sizeof(*rec), 1, f) == 1; ++i) {
+            if (rec->key == (uint32_t) (BENCH_UID_BASE + u) + 1) {
+                r = 0;
+                break;
+            }
+        }
+    }
+    fclose(f);
+    return r;
+}
+
+/* usage=: teardowns are accounted for in .usage, the largest one kept */
+static void
+scenario_usage(void)
+{
+    char path[PATH_MAX + 8];
+    struct usage_record rec;
+    pam_handle_t *h;
+    uint64_t bytes;
+
+    if (setup("usage", "usage=8") < 0)
+        return;
+    h = open_session(0, NULL);
+    if (!expect(h != NULL, "session of uid %d failed", BENCH_UID_BASE))
+        return;
+    dir_of(path, 0);
+    expect(write_file(path, "big", 65536) == 0, "can't write in %s", path);
+    strcat(path, "/sub");
+    expect(mkdir(path, 0700) == 0 && write_file(path, "small", 1) == 0,
+           "can't write in %s", path);
+    expect(close_session(h) == 0, "closing session of uid %d failed", BENCH_UID_BASE);
+
+    if (!expect(read_usage(0, &rec) == 0, "no usage record of uid %d", BENCH_UID_BASE))
+        return;
+    expect(rec.teardowns == 1, "%u teardowns recorded instead of 1", rec.teardowns);
+    expect(rec.entries >= 3, "%llu entries recorded, at least 3 removed",
+           (unsigned long long) rec.entries);
+    expect(rec.bytes >= 65536, "%llu bytes recorded, at least 65536 removed",
+           (unsigned long long) rec.bytes);
+    expect(rec.last > 0 && rec.last <= time(NULL), "time of the teardown not recorded");
+    bytes = rec.total_bytes;
+
+    /* A smaller one adds up, but doesn't replace it as the largest */
+    expect(session(0) == 0, "session of uid %d failed", BENCH_UID_BASE);
+    if (!expect(read_usage(0, &rec) == 0, "no usage record of uid %d", BENCH_UID_BASE))
+        return;
+    expect(rec.teardowns == 2, "%u teardowns recorded instead of 2", rec.teardowns);
+    expect(rec.bytes >= 65536, "largest teardown replaced by a smaller one");
+    expect(rec.total_bytes >= bytes, "total bytes went down");
+    expect(read_usage(1, &rec) < 0, "usage record of uid %d, which had no session",
+           BENCH_UID_BASE + 1);
+}
+
+/* How rundir-status reported a user: sessions=, dir= and expires= of its line */
+struct status_line {
+    int sessions;
+    int dir;
+    long long expires;
+};
+
+/* Run rundir-status with options, filling lines (users 0 to n - 1) and
+ * totals, its summary line. Returns 0, or -1 if it didn't run. */
+static int
+run_status(const char *options, struct status_line *lines, int n, char *totals, size_t size)
+{
+    char cmd[PATH_MAX * 2 + 64];
+    char buf[512];
+    struct status_line l;
+    unsigned uid;
+    FILE *f;
+    int r;
+
+    snprintf(cmd, sizeof(cmd), "%s/rundir-status dir=%s %s", ctx.bindir, ctx.dir, options);
+    f = popen(cmd, "r");
+    if (f == NULL)
+        return -1;
+    totals[0] = '\0';
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        buf[strcspn(buf, "\n")] = '\0';
+        if (sscanf(buf, "uid=%u sessions=%d dir=%d expires=%lld", &uid, &l.sessions,
+                   &l.dir, &l.expires) == 4) {
+            if (uid >= BENCH_UID_BASE && uid < (unsigned) BENCH_UID_BASE + n)
+                lines[uid - BENCH_UID_BASE] = l;
+            else
+                expect(0, "rundir-status reported unknown uid %u", uid);
+        } else if (strncmp(buf, "rundir-status ", 14) == 0) {
+            snprintf(totals, size, "%s", buf + 14);
+        }
+    }
+    r = pclose(f);
+    return (r == 0) ? 0 : -1;
+}
+
+/* rundir-status: what it reports, per user and in total, is the tree's state:
+ * open sessions, lingering directories, and a directory gone while in use */
+static void
+scenario_status(void)
+{
+    static const char *const options[] = { "linger=60", "counters=table linger=60" };
+    struct status_line lines[4];
+    char totals[512];
+    pam_handle_t *h[3];
+    char path[PATH_MAX];
+    time_t now;
+    size_t i;
+    int u;
+
+    for (i = 0; i < sizeof(options) / sizeof(*options); ++i) {
+        if (setup("status", options[i]) < 0)
+            return;
+        /* Two sessions; a lingering one; one whose directory is gone */
+        h[0] = open_session(0, NULL);
+        h[1] = open_session(0, NULL);
+        expect(session(1) == 0, "session of uid %d failed", BENCH_UID_BASE + 1);
+        h[2] = open_session(3, NULL);
+        expect(h[0] && h[1] && h[2], "sessions failed (%s)", options[i]);
+        rmdir(dir_of(path, 3));
+        now = time(NULL);
+
+        for (u = 0; u < 4; ++u)
+            lines[u].sessions = -3;
+        if (!expect(run_status(options[i], lines, 4, totals, sizeof(totals)) == 0,
+                    "rundir-status failed (%s)", options[i]))
+            return;
+        expect(lines[0].sessions == 2 && lines[0].dir == 1 && lines[0].expires == 0,
+               "uid %d reported as sessions=%d dir=%d expires=%lld, not 2 sessions (%s)",
+               BENCH_UID_BASE, lines[0].sessions, lines[0].dir, lines[0].expires, options[i]);
+        expect(lines[1].sessions == 0 && lines[1].dir == 1 && lines[1].expires > now,
+               "uid %d reported as sessions=%d dir=%d expires=%lld, not lingering (%s)",
+               BENCH_UID_BASE + 1, lines[1].sessions, lines[1].dir, lines[1].expires,
+               options[i]);
+        expect(lines[2].sessions == -3, "uid %d reported, without counter nor directory (%s)",
+               BENCH_UID_BASE + 2, options[i]);
+        expect(lines[3].sessions == 1 && lines[3].dir == 0,
+               "uid %d reported as sessions=%d dir=%d, not a session without directory (%s)",
+               BENCH_UID_BASE + 3, lines[3].sessions, lines[3].dir, options[i]);
+        expect(strcmp(totals, "users=3 sessions=3 dirs=2 lingering=1 unusable=0 errors=0") == 0,
+               "rundir-status totals %s (%s)", totals, options[i]);
+
+        for (u = 0; u < 3; ++u)
+            close_session(h[u]);
+        nftw(ctx.dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+    }
+}
+
+static const struct scenario {
+    const char *name;
+    void (*run)(void);
+} scenarios[] = {
+    { "linger", scenario_linger },
+    { "registry", scenario_registry },
+    { "gc", scenario_gc },
+    { "migration", scenario_migration },
+    { "include", scenario_include },
+    { "extra_dir", scenario_extra_dir },
+    { "pool", scenario_pool },
+    { "skel", scenario_skel },
+    { "usage", scenario_usage },
+    { "status", scenario_status },
+};
+
+#define NB_SCENARIOS (sizeof(scenarios) / sizeof(*scenarios))
+
+static void
+usage(int status)
+{
+    size_t i;
+
+    fprintf(status ? stderr : stdout, "Usage: scenarios MODULE [SCENARIO]...\nScenarios:");
+    for (i = 0; i < NB_SCENARIOS; ++i)
+        fprintf(status ? stderr : stdout, " %s", scenarios[i].name);
+    fputc('\n', status ? stderr : stdout);
+    exit(status);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct timespec ts = { 0, 100000000 };
+    char module[PATH_MAX];
+    long total = 0, failed = 0;
+    size_t i;
+    int opt;
+    int a;
+
+    while ((opt = getopt(argc, argv, "h")) != -1) {
+        switch (opt) {
+            case 'h': usage(0); break;
+            default: usage(1);
+        }
+    }
+    if (argc - optind < 1)
+        usage(1);
+    if (realpath(argv[optind], module) == NULL) {
+        fprintf(stderr, "scenarios: %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    for (a = optind + 1; a < argc; ++a) {
+        for (i = 0; i < NB_SCENARIOS && strcmp(argv[a], scenarios[i].name) != 0; ++i)
+            ;
+        if (i == NB_SCENARIOS)
+            usage(1);
+    }
+    if (geteuid() != 0) {
+        fprintf(stderr, "scenarios: must be run as root\n");
+        return 1;
+    }
+
+    ctx.module = module;
+    snprintf(ctx.bindir, sizeof(ctx.bindir), "%.*s", (int) (strrchr(module, '/') - module),
+             module);
+    snprintf(ctx.confdir, sizeof(ctx.confdir), "/tmp/pam_rundir_scenarios.XXXXXX");
+    if (mkdtemp(ctx.confdir) == NULL) {
+        perror("scenarios: mkdtemp");
+        return 1;
+    }
+
+    for (i = 0; i < NB_SCENARIOS; ++i) {
+        if (argc - optind > 1) {
+            for (a = optind + 1; a < argc && strcmp(argv[a], scenarios[i].name) != 0; ++a)
+                ;
+            if (a == argc)
+                continue;
+        }
+        scenarios[i].run();
+        if (ctx.failed)
+            printf("scenarios %s failed=%ld\n", scenarios[i].name, ctx.failed);
+        else
+            printf("scenarios %s ok\n", scenarios[i].name);
+        fflush(stdout);
+        ++total;
+        failed += ctx.failed > 0;
+    }
+
+    printf("scenarios total=%ld failed=%ld\n", total, failed);
+    /* A reaper (see reaper=) may still be at work in there, and recreate what
+     * was just removed: try again for up to 5 seconds */
+    for (i = 0; i < 50; ++i) {
+        nftw(ctx.confdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+        if (access(ctx.confdir, F_OK) < 0)
+            break;
+        nanosleep(&ts, NULL);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,509 @@
+/*
+ * pam_rundir - Copyright (C) 2015 Olivier Brunel
+ *
+ * test/stress.c
+ * Multi-process, multi-threaded stress test of open/close session, with fault
+ * injection, and checks of counters against runtime directories afterwards.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see http://www.gnu.org/licenses/
+ */
+
+/*
+ * Usage: stress [OPTION]... MODULE
+ *
+ * Runs PROCS processes at once, each with THREADS threads doing OPS randomized
+ * opens and closes of sessions (holding up to MAX_HELD at a time) for USERS
+ * users, loading the module through libpam with a private service file, as the
+ * benchmark does. Threads of a process share the module, each with its own PAM
+ * handles, which checks it is safe to use from several threads at once.
+ * Faults are injected by stress_fault.so, which must be preloaded along with
+ * bench_nss.so (see `make stress`), and processes kill themselves while
+ * holding sessions.
+ *
+ * After every run, the counter of each user is checked against what the
+ * processes saw: it must be at most the sessions opened minus those closed,
+ * and at least that minus the closes that failed (which may or may not have
+ * been counted), and minus the sessions of killed processes with registry
+ * (unless ignored, with counters=table).
+ * Processes only kill themselves with a single thread: another thread could be
+ * in the middle of an open, which then can't be accounted for.
+ * Its runtime directory must exist, owned by the user, if and only if the
+ * counter isn't 0. One line is printed per run, and per violation:
+ *
+ *   stress run=1 procs=200 threads=1 sessions=36012 elapsed_ms=2410 sessions_per_s=14942 ...
+ *   stress violation run=1 uid=200001 count=3 expected=1..2 dir=yes
+ *
+ * Options:
+ *   -p PROCS     concurrent processes [200]
+ *   -t THREADS   threads per process [1]
+ *   -n OPS       opens/closes per process [100]
+ *   -u USERS     distinct users [4]
+ *   -r RUNS      runs, state carrying over [3]
+ *   -e EINTR     calls per 10000 failing with EINTR [50]
+ *   -s ENOSPC    counter writes per 10000 failing with ENOSPC [20]
+ *   -k KILL      opens per 10000 after which the process kills itself [20]
+ *   -o OPTIONS   module options, appended after dir= and reaper= (the
+ *                rundir-gc next to MODULE)
+ *
+ * Rates can be 0. Must be run as root; everything happens in a temporary
+ * directory (service file, and dir= of the module), removed afterwards.
+ * Exits with 1 if any violation was found.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <security/pam_appl.h>
+#include <pthread.h>
+#include <ftw.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bench.h"
+#include "stress.h"
+
+#define SERVICE "rundir-stress"
+#define MAX_HELD 4                 /* Sessions a process holds at once */
+#define MAX_USERS 64
+#define MAX_THREADS 1024
+
+/* Counter formats, see pam_rundir(8) */
+#define COUNTER_MAGIC 0x43445252
+#define COUNTER_UNUSABLE 0x0001
+#define TABLE_MAGIC 0x42544452
+
+struct config {
+    long procs;
+    long threads;
+    long ops;
+    long users;
+    long runs;
+    long eintr;
+    long enospc;
+    long kill;
+    const char *options;
+};
+
+/* What processes saw for a user, shared with them, cumulated over runs */
+struct account {
+    long opens;                    /* Successful */
+    long open_errors;
+    long closes;                   /* Successful */
+    long close_errors;
+    long killed;                   /* Sessions held by processes that killed themselves */
+};
+
+struct shared {
+    struct account users[MAX_USERS];
+    long sessions;                 /* Opened in the current run */
+};
+
+static int
+conv(int n, const struct pam_message **msg, struct pam_response **resp, void *data)
+{
+    (void)n;
+    (void)msg;
+    (void)resp;
+    (void)data;
+    return PAM_CONV_ERR;
+}
+
+static int64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)ftw;
+    return (type == FTW_DP) ? rmdir(path) : unlink(path);
+}
+
+static void
+add(long *counter, long n)
+{
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+/* Open a session of user u, returning its handle, or NULL */
+static pam_handle_t *
+open_session(const char *confdir, long u, struct shared *sh)
+{
+    struct pam_conv c = { conv, NULL };
+    char user[64];
+    pam_handle_t *h;
+
+    snprintf(user, sizeof(user), "%s%ld", BENCH_USER_PREFIX, u);
+    if (pam_start_confdir(SERVICE, user, &c, confdir, &h) != PAM_SUCCESS) {
+        add(&sh->users[u].open_errors, 1);
+        return NULL;
+    }
+    if (pam_open_session(h, 0) != PAM_SUCCESS) {
+        add(&sh->users[u].open_errors, 1);
+        pam_end(h, PAM_SESSION_ERR);
+        return NULL;
+    }
+    add(&sh->users[u].opens, 1);
+    add(&sh->sessions, 1);
+    return h;
+}
+
+static void
+close_session(pam_handle_t *h, long u, struct shared *sh)
+{
+    int r = pam_close_session(h, 0);
+
+    add((r == PAM_SUCCESS) ? &sh->users[u].closes : &sh->users[u].close_errors, 1);
+    pam_end(h, r);
+}
+
+/* What a thread of a process works with */
+struct worker {
+    pthread_t thread;
+    const struct config *cfg;
+    const char *confdir;
+    struct shared *sh;
+    unsigned seed;
+};
+
+/* Randomized opens and closes, then close whatever's still held */
+static void *
+worker(void *data)
+{
+    const struct worker *w = data;
+    const struct config *cfg = w->cfg;
+    const char *confdir = w->confdir;
+    struct shared *sh = w->sh;
+    pam_handle_t *held[MAX_HELD];
+    long user[MAX_HELD];
+    unsigned seed = w->seed;
+    int n = 0;
+    long i;
+    int k;
+
+    for (i = 0; i < cfg->ops; ++i) {
+        if (n < MAX_HELD && (n == 0 || rand_r(&seed) % 2)) {
+            long u = rand_r(&seed) % cfg->users;
+
+            held[n] = open_session(confdir, u, sh);
+            if (held[n] == NULL)
+                continue;
+            user[n++] = u;
+
+            /* Killed mid-session: what's held is never closed */
+            if (cfg->threads == 1 && rand_r(&seed) % 10000 < cfg->kill) {
+                for (k = 0; k < n; ++k)
+                    add(&sh->users[user[k]].killed, 1);
+                raise(SIGKILL);
+            }
+        } else {
+            k = rand_r(&seed) % n;
+            close_session(held[k], user[k], sh);
+            held[k] = held[--n];
+            user[k] = user[n];
+        }
+    }
+    while (n > 0) {
+        --n;
+        close_session(held[n], user[n], sh);
+    }
+    return NULL;
+}
+
+/* Run the threads of a process, the first one in the calling thread */
+static void
+run_workers(const struct config *cfg, const char *confdir, struct shared *sh)
+{
+    struct worker w[MAX_THREADS];
+    long t;
+
+    for (t = 0; t < cfg->threads; ++t) {
+        w[t].cfg = cfg;
+        w[t].confdir = confdir;
+        w[t].sh = sh;
+        w[t].seed = (unsigned) getpid() ^ (unsigned) now_ns() ^ (unsigned) t * 2654435761u;
+        if (t > 0 && pthread_create(&w[t].thread, NULL, worker, &w[t]) != 0) {
+            perror("stress: pthread_create");
+            _exit(1);
+        }
+    }
+    worker(&w[0]);
+    for (t = 1; t < cfg->threads; ++t)
+        pthread_join(w[t].thread, NULL);
+}
+
+/* The counter of uid in parent dir dir: >= 0, -2 if not usable, -1 if it
+ * can't be read. A missing counter is 0. */
+static long
+read_count(const char *dir, uid_t uid)
+{
+    struct {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t flags;
+        uint32_t count;
+        uint32_t check;
+    } rec;
+    char path[PATH_MAX + 64];
+    ssize_t r;
+    int fd;
+
+    /* Table: 32-byte header, then 32-byte slots of key (uid + 1) and count */
+    snprintf(path, sizeof(path), "%s/.counters", dir);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        uint32_t hdr[8];
+        int32_t slot[8];
+        uint32_t i;
+
+        if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr[0] != TABLE_MAGIC) {
+            close(fd);
+            return -1;
+        }
+        for (i = 0; i < hdr[2]; ++i) {
+            if (pread(fd, slot, sizeof(slot), (off_t) (i + 1) * sizeof(slot)) != sizeof(slot))
+                break;
+            if ((uint32_t) slot[0] == (uint32_t) uid + 1) {
+                close(fd);
+                return (slot[1] < 0) ? -2 : slot[1];
+            }
+        }
+        close(fd);
+        return 0;
+    }
+
+    /* Counter file: magic, version and flags, count, checksum */
+    snprintf(path, sizeof(path), "%s/.%u", dir, (unsigned) uid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return (errno == ENOENT) ? 0 : -1;
+    r = pread(fd, &rec, sizeof(rec), 0);
+    close(fd);
+    if (r == 0)
+        return 0;
+    if (r != sizeof(rec) || rec.magic != COUNTER_MAGIC)
+        return -1;
+    return (rec.flags & COUNTER_UNUSABLE) ? -2 : (long) rec.count;
+}
+
+/* Check every user's counter and runtime directory after run run. Returns the
+ * number of violations. */
+static long
+check(const struct config *cfg, const char *dir, const struct shared *sh, long run)
+{
+    /* The registry needs counter files, it is ignored with the table */
+    const int registry = strstr(cfg->options, "registry") != NULL
+        && strstr(cfg->options, "counters=table") == NULL;
+    const int linger = strstr(cfg->options, "linger=") != NULL;
+    long violations = 0;
+    long u;
+
+    for (u = 0; u < cfg->users; ++u) {
+        const struct account *a = &sh->users[u];
+        const uid_t uid = BENCH_UID_BASE + u;
+        char path[PATH_MAX + 64];
+        struct stat st;
+        long hi = a->opens - a->closes;
+        long lo = hi - a->close_errors;
+        long count = read_count(dir, uid);
+        int exists;
+
+        /* Killed sessions were pruned when settling */
+        if (registry) {
+            hi -= a->killed;
+            lo -= a->killed;
+        }
+        if (lo < 0)
+            lo = 0;
+
+        snprintf(path, sizeof(path), "%s/%u", dir, (unsigned) uid);
+        exists = lstat(path, &st) == 0;
+        /* Not usable is 0 sessions, after the directory couldn't be removed:
+         * whatever's left of it is there */
+        if (count == -2 && lo == 0)
+            continue;
+        if (count < lo || count > hi
+                || (count > 0 && (!exists || !S_ISDIR(st.st_mode) || st.st_uid != uid))
+                || (count == 0 && exists && !linger)) {
+            printf("stress violation run=%ld uid=%u count=%ld expected=%ld..%ld dir=%s\n",
+                   run, (unsigned) uid, count, lo, hi,
+                   !exists ? "no" : (S_ISDIR(st.st_mode) && st.st_uid == uid) ? "yes" : "bad");
+            ++violations;
+        }
+    }
+    return violations;
+}
+
+static void
+usage(int status)
+{
+    fprintf(status ? stderr : stdout,
+            "Usage: stress [-p PROCS] [-t THREADS] [-n OPS] [-u USERS] [-r RUNS] [-e EINTR]"
+            " [-s ENOSPC] [-k KILL] [-o OPTIONS] MODULE\n");
+    exit(status);
+}
+
+static long
+parse_long(const char *s, long min)
+{
+    char *end;
+    long v;
+
+    errno = 0;
+    v = strtol(s, &end, 10);
+    if (errno != 0 || end == s || *end != '\0' || v < min)
+        usage(1);
+    return v;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct config cfg = { 200, 1, 100, 4, 3, 50, 20, 20, "" };
+    struct timespec ts = { 0, 100000000 };
+    char confdir[] = "/tmp/pam_rundir_stress.XXXXXX";
+    char module[PATH_MAX];
+    char path[PATH_MAX + 32];
+    char faults[64];
+    struct shared *sh;
+    long violations = 0;
+    long run;
+    long p;
+    FILE *f;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "hp:t:n:u:r:e:s:k:o:")) != -1) {
+        switch (opt) {
+            case 'p': cfg.procs = parse_long(optarg, 1); break;
+            case 't': cfg.threads = parse_long(optarg, 1); break;
+            case 'n': cfg.ops = parse_long(optarg, 1); break;
+            case 'u': cfg.users = parse_long(optarg, 1); break;
+            case 'r': cfg.runs = parse_long(optarg, 1); break;
+            case 'e': cfg.eintr = parse_long(optarg, 0); break;
+            case 's': cfg.enospc = parse_long(optarg, 0); break;
+            case 'k': cfg.kill = parse_long(optarg, 0); break;
+            case 'o': cfg.options = optarg; break;
+            case 'h': usage(0); break;
+            default: usage(1);
+        }
+    }
+    if (argc - optind != 1 || cfg.users > MAX_USERS || cfg.threads > MAX_THREADS)
+        usage(1);
+    if (realpath(argv[optind], module) == NULL) {
+        fprintf(stderr, "stress: %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    if (geteuid() != 0) {
+        fprintf(stderr, "stress: must be run as root\n");
+        return 1;
+    }
+
+    /* Private service file, with dir= inside our temporary directory */
+    if (mkdtemp(confdir) == NULL) {
+        perror("stress: mkdtemp");
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/%s", confdir, SERVICE);
+    f = fopen(path, "w");
+    if (f == NULL) {
+        perror("stress: fopen");
+        return 1;
+    }
+    fprintf(f, "session required %s dir=%s/run reaper=%.*s/rundir-gc %s\n", module, confdir,
+            (int) (strrchr(module, '/') - module), module, cfg.options);
+    fclose(f);
+
+    sh = mmap(NULL, sizeof(*sh), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sh == MAP_FAILED) {
+        perror("stress: mmap");
+        return 1;
+    }
+    snprintf(faults, sizeof(faults), "%ld,%ld", cfg.eintr, cfg.enospc);
+    snprintf(path, sizeof(path), "%s/run", confdir);
+
+    for (run = 1; run <= cfg.runs; ++run) {
+        long open_errors = 0, close_errors = 0, killed = 0;
+        int64_t start, elapsed;
+        int status;
+        long u;
+
+        sh->sessions = 0;
+        start = now_ns();
+        for (p = 0; p < cfg.procs; ++p) {
+            pid_t pid = fork();
+
+            if (pid < 0) {
+                perror("stress: fork");
+                return 1;
+            } else if (pid == 0) {
+                setenv(STRESS_FAULTS_ENV, faults, 1);
+                run_workers(&cfg, confdir, sh);
+                _exit(0);
+            }
+        }
+        while (wait(&status) > 0 || errno == EINTR)
+            ;
+        elapsed = now_ns() - start;
+
+        /* Without faults, one session per user has the module catch up with
+         * dead ones (registry), and reap what's left in the trash */
+        for (u = 0; u < cfg.users; ++u) {
+            pam_handle_t *h = open_session(confdir, u, sh);
+
+            if (h != NULL)
+                close_session(h, u, sh);
+        }
+
+        for (u = 0; u < cfg.users; ++u) {
+            open_errors += sh->users[u].open_errors;
+            close_errors += sh->users[u].close_errors;
+            killed += sh->users[u].killed;
+        }
+        printf("stress run=%ld procs=%ld threads=%ld users=%ld sessions=%ld elapsed_ms=%lld"
+               " sessions_per_s=%.0f open_errors=%ld close_errors=%ld killed=%ld\n",
+               run, cfg.procs, cfg.threads, cfg.users, sh->sessions, (long long) (elapsed / 1000000),
+               (double) sh->sessions * 1e9 / (double) (elapsed ? elapsed : 1),
+               open_errors, close_errors, killed);
+        fflush(stdout);
+        violations += check(&cfg, path, sh, run);
+    }
+
+    printf("stress runs=%ld violations=%ld\n", cfg.runs, violations);
+    /* A reaper (see reaper=) may still be at work in there, and recreate what
+     * was just removed: try again for up to 5 seconds */
+    for (i = 0; i < 50; ++i) {
+        nftw(confdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+        if (access(confdir, F_OK) < 0)
+            break;
+        nanosleep(&ts, NULL);
+    }
+    return violations ? 1 : 0;
+}
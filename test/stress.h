@@ -0,0 +1,29 @@
+/*
+ * pam_rundir - Copyright (C) 2015 Olivier Brunel
+ *
+ * test/stress.h
+ * Shared between the stress test and its fault injection shim.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see http://www.gnu.org/licenses/
+ */
+
+#ifndef PAM_RUNDIR_STRESS_H
+#define PAM_RUNDIR_STRESS_H
+
+/* Faults injected by stress_fault.so, as "EINTR,ENOSPC": how many calls per
+ * 10000 fail with EINTR (open, openat, pread, pwrite, flock) and ENOSPC
+ * (pwrite to a regular file). Unset, nothing is injected. */
+#define STRESS_FAULTS_ENV "STRESS_FAULTS"
+
+#endif /* PAM_RUNDIR_STRESS_H */
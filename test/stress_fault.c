@@ -0,0 +1,141 @@
+/*
+ * pam_rundir - Copyright (C) 2015 Olivier Brunel
+ *
+ * test/stress_fault.c
+ * Fault injection shim for the stress test, to be preloaded: makes some
+ * syscalls fail as set in STRESS_FAULTS_ENV.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see http://www.gnu.org/licenses/
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stress.h"
+
+enum fault { FAULT_EINTR, FAULT_ENOSPC };
+
+/* Whether to inject fault now. The environment is looked up on every call,
+ * so the stress test can turn faults off in its own process. */
+static int
+inject(enum fault fault)
+{
+    static __thread unsigned seed;
+    const char *s = getenv(STRESS_FAULTS_ENV);
+    long rate[2] = { 0, 0 };
+
+    if (s == NULL || sscanf(s, "%ld,%ld", &rate[0], &rate[1]) < 1 || rate[fault] <= 0)
+        return 0;
+    if (seed == 0)
+        seed = (unsigned) getpid() * 2654435761u + (unsigned) (unsigned long) &seed;
+    return rand_r(&seed) % 10000 < rate[fault];
+}
+
+int
+open(const char *path, int flags, ...)
+{
+    static int (*real)(const char *, int, ...);
+    mode_t mode = 0;
+    va_list ap;
+
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    if (inject(FAULT_EINTR)) {
+        errno = EINTR;
+        return -1;
+    }
+    if (real == NULL)
+        real = (int (*)(const char *, int, ...)) dlsym(RTLD_NEXT, "open");
+    return real(path, flags, mode);
+}
+
+int
+openat(int dirfd, const char *path, int flags, ...)
+{
+    static int (*real)(int, const char *, int, ...);
+    mode_t mode = 0;
+    va_list ap;
+
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+    if (inject(FAULT_EINTR)) {
+        errno = EINTR;
+        return -1;
+    }
+    if (real == NULL)
+        real = (int (*)(int, const char *, int, ...)) dlsym(RTLD_NEXT, "openat");
+    return real(dirfd, path, flags, mode);
+}
+
+ssize_t
+pread(int fd, void *buf, size_t count, off_t offset)
+{
+    static ssize_t (*real)(int, void *, size_t, off_t);
+
+    if (inject(FAULT_EINTR)) {
+        errno = EINTR;
+        return -1;
+    }
+    if (real == NULL)
+        real = (ssize_t (*)(int, void *, size_t, off_t)) dlsym(RTLD_NEXT, "pread");
+    return real(fd, buf, count, offset);
+}
+
+ssize_t
+pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    static ssize_t (*real)(int, const void *, size_t, off_t);
+    struct stat st;
+
+    if (inject(FAULT_EINTR)) {
+        errno = EINTR;
+        return -1;
+    }
+    if (inject(FAULT_ENOSPC) && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (real == NULL)
+        real = (ssize_t (*)(int, const void *, size_t, off_t)) dlsym(RTLD_NEXT, "pwrite");
+    return real(fd, buf, count, offset);
+}
+
+int
+flock(int fd, int op)
+{
+    static int (*real)(int, int);
+
+    if (inject(FAULT_EINTR)) {
+        errno = EINTR;
+        return -1;
+    }
+    if (real == NULL)
+        real = (int (*)(int, int)) dlsym(RTLD_NEXT, "flock");
+    return real(fd, op);
+}
@@ -0,0 +1,67 @@
+/*
+ * pam_rundir - Copyright (C) 2015 Olivier Brunel
+ *
+ * trace.h
+ * Format of the trace ring (trace= option), shared between librundir, which
+ * writes it, and the replay tool (test/replay.c), which reads it.
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 2 of the License, or (at your option) any later
+ * version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see http://www.gnu.org/licenses/
+ */
+
+#ifndef PAM_RUNDIR_TRACE_H
+#define PAM_RUNDIR_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_NAME ".trace"        /* Trace ring, inside PARENT_DIR */
+#define TRACE_MAGIC 0x52544452     /* "RDTR" */
+#define TRACE_VERSION 1
+#define TRACE_PHASES 6             /* Phases timed in a record */
+#define TRACE_PHASE_NAMES { "nss", "parent", "lock", "counter", "create", "teardown" }
+
+/* Operations */
+#define TRACE_OPEN 1
+#define TRACE_CLOSE 2
+
+/* The ring is a header followed by its records, in host byte order. Writers
+ * claim the record at index next % records by incrementing next (atomically,
+ * through a shared mapping), overwriting the oldest once full. A record being
+ * written has seq 0, then its index + 1 once complete.
+ */
+struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t records;              /* Records in the ring */
+    uint32_t record_size;
+    uint64_t next;                 /* Index of the next record */
+    char pad[40];
+};
+
+struct trace_record {
+    uint64_t seq;                  /* Index + 1, 0 while being written */
+    int64_t time_ns;               /* Start of the operation, CLOCK_REALTIME */
+    uint64_t session;              /* Same for the open and the close of a session,
+                                      0 when opening failed */
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t pid;                  /* Process that did the operation */
+    uint8_t op;                    /* TRACE_OPEN or TRACE_CLOSE */
+    int8_t result;                 /* RUNDIR_* */
+    uint16_t pad;
+    uint32_t total_us;             /* Duration of the operation */
+    uint32_t us[TRACE_PHASES];     /* Time spent in each phase */
+    uint32_t entries;              /* Entries removed, when tearing down */
+};
+
+#endif /* PAM_RUNDIR_TRACE_H */